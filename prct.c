@@ -1,1176 +1,7486 @@
+#define _GNU_SOURCE // For accept4()
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <sys/types.h>
 #include <signal.h> // For kill() function
 #include <sys/wait.h>
 #include <unistd.h>
 #include <string.h>
+#include <dirent.h> // For scanning the /proc directory
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h> // For openat()
+#include <errno.h>
+#include <poll.h>
+#include <sys/syscall.h> // For the pidfd system calls
+#include <sys/resource.h>
+#include <limits.h> // For PATH_MAX
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/connector.h> // Kernel process events for watch mode
+#include <linux/cn_proc.h>
+#include <sys/epoll.h> // Query server
+#include <sys/un.h>
+#include <sys/mman.h> // Snapshot files
+#include <sys/stat.h>
+#include <stdint.h>
+#include <termios.h> // Live view
+#include <sys/ioctl.h>
+#include <linux/io_uring.h> // Batched /proc reads
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSE2 and AVX2 state scan kernels
+#endif
+
+// Older C libraries don't know the pidfd system call numbers yet
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+
+// Growable piece of text, used by the output layer
+struct text
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+// Make room for more bytes, returns 0 if memory ran out
+int text_reserve(struct text *text, size_t extra)
+{
+    if (text->length + extra <= text->capacity)
+    {
+        return 1;
+    }
+    size_t capacity = text->capacity ? text->capacity : 4096;
+    while (capacity < text->length + extra)
+    {
+        capacity *= 2;
+    }
+    char *grown = realloc(text->data, capacity);
+    if (grown == NULL)
+    {
+        return 0;
+    }
+    text->data = grown;
+    text->capacity = capacity;
+    return 1;
+}
+
+void text_append(struct text *text, const char *data, size_t length)
+{
+    if (length > 0 && text_reserve(text, length))
+    {
+        memcpy(text->data + text->length, data, length);
+        text->length += length;
+    }
+}
+
+// Two digits at a time, so a PID takes three or four steps instead of seven
+const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Append a number as decimal text without going through printf
+void text_number(struct text *text, long long number)
+{
+    char digits[24];
+    char *end = digits + sizeof(digits);
+    char *start = end;
+    unsigned long long value = number < 0 ? -(unsigned long long)number : (unsigned long long)number;
+
+    while (value >= 100)
+    {
+        int pair = (value % 100) * 2;
+        value /= 100;
+        *--start = digit_pairs[pair + 1];
+        *--start = digit_pairs[pair];
+    }
+    if (value >= 10)
+    {
+        *--start = digit_pairs[value * 2 + 1];
+        *--start = digit_pairs[value * 2];
+    }
+    else
+    {
+        *--start = '0' + value;
+    }
+    if (number < 0)
+    {
+        *--start = '-';
+    }
+    text_append(text, start, end - start);
+}
+
+// Append a string as a quoted JSON string
+void text_json_string(struct text *text, const char *string)
+{
+    text_append(text, "\"", 1);
+    for (const char *c = string; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            char escaped[2] = {'\\', *c};
+            text_append(text, escaped, 2);
+        }
+        else if ((unsigned char)*c < 0x20)
+        {
+            char escaped[8];
+            int length = snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)*c);
+            text_append(text, escaped, length);
+        }
+        else
+        {
+            text_append(text, c, 1);
+        }
+    }
+    text_append(text, "\"", 1);
+}
+
+// Output formats, picked with --format
+#define FORMAT_PLAIN 0  // Text lines, as the program always printed them
+#define FORMAT_JSON 1   // One JSON document: an object per query, an array of them in batch mode
+#define FORMAT_NDJSON 2 // One JSON object per query, one per line
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+// Every answer the program gives goes through here. Text is gathered in one
+// big buffer and handed to write() when the buffer fills up or an answer is
+// finished, instead of one stdio call per PID. In the JSON formats the parts
+// of an answer are collected first and written as one object at the end.
+struct output
+{
+    struct text buffer; // Bytes waiting to be written
+    int fd;             // Where they go, -1 to keep them in memory (query server)
+    int interactive;    // Plain text to a terminal: write every line right away
+    int format;         // FORMAT_PLAIN, FORMAT_JSON or FORMAT_NDJSON
+    int as_array;       // JSON: answers go into one array (batch mode)
+    int answers;        // Answers finished so far
+    // JSON: the answer being built
+    int root;
+    int pid;
+    char option[16];
+    struct text pids;     // PIDs the answer is about, as a JSON list body
+    struct text messages; // Text lines, as a JSON list body
+    long long count;
+    int has_count;
+};
+struct output out = {.fd = STDOUT_FILENO};
+
+// Write everything waiting in the buffer
+void output_flush(void)
+{
+    if (out.fd == -1)
+    {
+        return; // The query server takes the buffer itself
+    }
+    size_t written = 0;
+    while (written < out.buffer.length)
+    {
+        ssize_t result = write(out.fd, out.buffer.data + written, out.buffer.length - written);
+        if (result == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break; // Nobody is reading any more, drop the rest
+        }
+        written += result;
+    }
+    out.buffer.length = 0;
+}
+
+// Add bytes to the buffer, writing it out first if they don't fit
+void output_bytes(const char *data, size_t length)
+{
+    if (out.fd != -1 && out.buffer.length + length > OUTPUT_BUFFER_SIZE)
+    {
+        output_flush();
+    }
+    text_append(&out.buffer, data, length);
+}
+
+// Plain text is finished line by line, flush it if a person is watching
+void output_line_done(void)
+{
+    if (out.interactive)
+    {
+        output_flush();
+    }
+}
+
+// One PID of a result list
+void write_pid(int pid)
+{
+    if (out.format != FORMAT_PLAIN)
+    {
+        if (out.pids.length > 0)
+        {
+            text_append(&out.pids, ",", 1);
+        }
+        text_number(&out.pids, pid);
+        return;
+    }
+    if (out.fd != -1 && out.buffer.length + 16 > OUTPUT_BUFFER_SIZE)
+    {
+        output_flush();
+    }
+    text_number(&out.buffer, pid);
+    text_append(&out.buffer, "\n", 1);
+    output_line_done();
+}
+
+// A PID something was done to, printed as "<label>: <pid>" in plain text
+void write_labeled_pid(const char *label, int pid)
+{
+    if (out.format == FORMAT_PLAIN)
+    {
+        output_bytes(label, strlen(label));
+        output_bytes(": ", 2);
+    }
+    write_pid(pid);
+}
+
+// A count, the whole answer of options like -dc
+void write_count(long long count)
+{
+    if (out.format != FORMAT_PLAIN)
+    {
+        out.count = count;
+        out.has_count = 1;
+        return;
+    }
+    text_number(&out.buffer, count);
+    output_bytes("\n", 1);
+    output_line_done();
+}
+
+// Any other line of text: headers, "not found" notes and errors
+void write_text(const char *format, ...)
+{
+    char line[512];
+    char *text = line;
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length < 0)
+    {
+        return;
+    }
+
+    // Long lines (cgroup paths) get a buffer of their own
+    if (length >= (int)sizeof(line))
+    {
+        text = malloc(length + 1);
+        if (text == NULL)
+        {
+            return;
+        }
+        va_start(args, format);
+        vsnprintf(text, length + 1, format, args);
+        va_end(args);
+    }
+
+    if (out.format == FORMAT_PLAIN)
+    {
+        output_bytes(text, length);
+        output_line_done();
+    }
+    else
+    {
+        // JSON keeps each line as one string, without its newline
+        while (length > 0 && text[length - 1] == '\n')
+        {
+            text[--length] = '\0';
+        }
+        if (out.messages.length > 0)
+        {
+            text_append(&out.messages, ",", 1);
+        }
+        text_json_string(&out.messages, text);
+    }
+
+    if (text != line)
+    {
+        free(text);
+    }
+}
+
+// Start the answer to one query
+void output_begin(int root, int pid, const char *option)
+{
+    out.root = root;
+    out.pid = pid;
+    snprintf(out.option, sizeof(out.option), "%s", option != NULL ? option : "");
+    out.pids.length = 0;
+    out.messages.length = 0;
+    out.has_count = 0;
+}
+
+// Finish the answer to one query. The JSON formats write it out here.
+void output_end(int status)
+{
+    if (out.format != FORMAT_PLAIN)
+    {
+        struct text *buffer = &out.buffer;
+        if (out.as_array)
+        {
+            text_append(buffer, out.answers == 0 ? "[" : ",", 1);
+        }
+        text_append(buffer, "{\"root\":", 8);
+        text_number(buffer, out.root);
+        text_append(buffer, ",\"pid\":", 7);
+        text_number(buffer, out.pid);
+        text_append(buffer, ",\"option\":", 10);
+        if (out.option[0] != '\0')
+        {
+            text_json_string(buffer, out.option);
+        }
+        else
+        {
+            text_append(buffer, "null", 4);
+        }
+        text_append(buffer, ",\"status\":", 10);
+        text_number(buffer, status);
+        text_append(buffer, ",\"pids\":[", 9);
+        text_append(buffer, out.pids.data, out.pids.length);
+        text_append(buffer, "]", 1);
+        if (out.has_count)
+        {
+            text_append(buffer, ",\"count\":", 9);
+            text_number(buffer, out.count);
+        }
+        text_append(buffer, ",\"messages\":[", 13);
+        text_append(buffer, out.messages.data, out.messages.length);
+        text_append(buffer, out.as_array ? "]}" : "]}\n", out.as_array ? 2 : 3);
+        if (out.fd != -1 && out.buffer.length > OUTPUT_BUFFER_SIZE)
+        {
+            output_flush();
+        }
+    }
+    out.answers++;
+}
+
+// Close the JSON array of batch mode and write whatever is left
+void output_finish(void)
+{
+    if (out.format != FORMAT_PLAIN && out.as_array)
+    {
+        text_append(&out.buffer, out.answers == 0 ? "[]\n" : "]\n", out.answers == 0 ? 3 : 2);
+    }
+    output_flush();
+}
+
+// Bump allocator. Memory is carved out of big blocks and only given back all
+// at once, so one snapshot costs a handful of heap allocations however many
+// processes it holds, and dropping it leaves no holes in the heap.
+struct arena_block
+{
+    struct arena_block *next; // Older block
+    size_t size;              // Usable bytes after the header
+    size_t used;
+};
+
+struct arena
+{
+    struct arena_block *blocks; // Newest block first
+    void *last;                 // Most recent allocation, the only one that can grow in place
+    size_t last_size;
+};
+
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define ARENA_ALIGN 16
+#define ARENA_HEADER ((sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+// Counters for --stats, updated from every scanner thread
+long arena_allocations = 0; // Allocations served by arenas
+long arena_heap_blocks = 0; // Blocks arenas took from the heap
+long arena_heap_bytes = 0;  // Bytes in those blocks
+
+// Get memory from an arena, NULL if the heap is exhausted
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    struct arena_block *block = arena->blocks;
+    if (block == NULL || block->size - block->used < size)
+    {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(ARENA_HEADER + block_size);
+        if (block == NULL)
+        {
+            return NULL;
+        }
+        block->next = arena->blocks;
+        block->size = block_size;
+        block->used = 0;
+        arena->blocks = block;
+        __atomic_fetch_add(&arena_heap_blocks, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&arena_heap_bytes, (long)(ARENA_HEADER + block_size), __ATOMIC_RELAXED);
+    }
+
+    void *memory = (char *)block + ARENA_HEADER + block->used;
+    block->used += size;
+    arena->last = memory;
+    arena->last_size = size;
+    __atomic_fetch_add(&arena_allocations, 1, __ATOMIC_RELAXED);
+    return memory;
+}
+
+// Grow an allocation, keeping its contents. The latest allocation grows in
+// place when its block has room, anything else is copied to fresh memory and
+// the old copy stays in the arena until the arena is freed.
+void *arena_grow(struct arena *arena, void *old, size_t old_size, size_t new_size)
+{
+    new_size = (new_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    struct arena_block *block = arena->blocks;
+    if (old != NULL && old == arena->last && block->used - arena->last_size + new_size <= block->size)
+    {
+        block->used += new_size - arena->last_size;
+        arena->last_size = new_size;
+        return old;
+    }
+
+    void *memory = arena_alloc(arena, new_size);
+    if (memory != NULL && old != NULL)
+    {
+        memcpy(memory, old, old_size);
+    }
+    return memory;
+}
+
+// Give every block of an arena back to the heap
+void arena_free(struct arena *arena)
+{
+    while (arena->blocks != NULL)
+    {
+        struct arena_block *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+    arena->last = NULL;
+    arena->last_size = 0;
+}
+
+// One process in the snapshot table
+struct proc_entry
+{
+    int pid;                       // Process ID
+    int ppid;                      // Parent process ID
+    char state;                    // State letter from the stat file ('R', 'S', 'Z', 'T', ...)
+    char comm[16];                 // Process name, as shown between parentheses in the stat file
+    int pgrp;                      // Process group ID
+    int session;                   // Session ID
+    int tty_nr;                    // Controlling terminal, 0 if none
+    unsigned long utime;           // Time spent in user mode, in clock ticks
+    unsigned long stime;           // Time spent in kernel mode, in clock ticks
+    unsigned long long start_time; // Start time in clock ticks after boot
+    long rss;                      // Resident set size in pages
+    int first_child;               // Table index of the first child, -1 if no children
+    int next_sibling;              // Table index of the next child of the same parent, -1 if last
+    int enter;                     // Euler tour: number given when the walk enters the process, -1 if not numbered
+    int leave;                     // Euler tour: last number given inside its subtree
+};
+
+// Snapshot of the whole process table, built with a single scan of /proc
+struct proc_snapshot
+{
+    struct proc_entry *entries; // All processes we found
+    int count;                  // Number of used entries
+    int capacity;               // Number of allocated entries
+    int *index;                 // index[pid] = position in entries, -1 if not present
+    int max_pid;                // Largest PID stored in index
+    int loaded;                 // 1 once the snapshot has been built
+    int free_slot;              // Watch mode: first slot left empty by a removed process, -1 if none
+    double built_ms;            // When the last full scan finished
+    struct arena memory;        // Holds the entries and the index, freed together
+    void *mapping;              // Snapshot file the table lives in (--from), NULL after a scan
+    size_t mapping_size;
+};
+
+// The snapshot used by every option of the program
+struct proc_snapshot snapshot;
+
+// Bumped whenever parent/child links change, so cached answers and the tour
+// numbering know they are stale. A state change alone does not bump it:
+// snapshot_set_state() patches the state column in place instead
+unsigned long tree_generation = 0;
+
+// Euler tour numbering. One depth first walk over the whole table numbers each
+// process when the walk enters it, and records the last number used inside its
+// subtree when the walk leaves it. X is then in the subtree of R exactly when
+// R->enter <= X->enter and X->leave <= R->leave: two compares instead of a walk
+// up the parent chain.
+unsigned long tour_generation = 0; // tree_generation the numbers belong to, 0 if never numbered
+
+// The same walk also copies the fields filters look at into parallel arrays,
+// one slot per tour number. The descendants of a process are then the slots
+// enter + 1 to leave, and a filter like "state == 'Z' below this process" is a
+// plain loop over one small array instead of a pointer chase through the table.
+struct tour_columns
+{
+    int *pid;
+    int *ppid;
+    char *state;
+    long *rss;
+    int *leave;   // Last slot inside the subtree of each slot
+    int count;    // Number of filled slots
+    int capacity; // Number of allocated slots
+    int mapped;   // 1 if the arrays point into a loaded snapshot file
+};
+struct tour_columns columns;
+
+// Directory fd on /proc, opened once and shared by every reader
+int proc_fd = -1;
+
+// Open /proc once, returns the directory fd or -1
+int get_proc_fd(void)
+{
+    if (proc_fd == -1)
+    {
+        proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    return proc_fd;
+}
+
+// Write a positive number as text, returns a pointer just after the last digit
+char *put_number(char *out, int number)
+{
+    char digits[12];
+    int n = 0;
+    do
+    {
+        digits[n++] = '0' + number % 10;
+        number /= 10;
+    } while (number > 0);
+
+    while (n > 0)
+    {
+        *out++ = digits[--n];
+    }
+    return out;
+}
+
+// Open a file under /proc without going through stdio.
+// tid == 0 opens "<pid>/<name>", otherwise "<pid>/task/<tid>/<name>".
+int open_proc_file(int pid, int tid, const char *name)
+{
+    char path[64];
+    char *end = put_number(path, pid);
+    *end++ = '/';
+    if (tid > 0)
+    {
+        memcpy(end, "task/", 5);
+        end = put_number(end + 5, tid);
+        *end++ = '/';
+    }
+    int name_length = strlen(name);
+    if (end - path + name_length >= (int)sizeof(path))
+    {
+        return -1;
+    }
+    memcpy(end, name, name_length + 1);
+
+    return openat(get_proc_fd(), path, O_RDONLY | O_CLOEXEC);
+}
+
+// Read a small /proc file with one read() into the caller's buffer.
+// The text is NUL terminated. Returns the number of bytes read, -1 on error.
+int read_proc_file(int pid, int tid, const char *name, char *buf, int size)
+{
+    int fd = open_proc_file(pid, tid, name);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    int length = read(fd, buf, size - 1);
+    close(fd);
+    if (length < 0)
+    {
+        return -1;
+    }
+    buf[length] = '\0';
+    return length;
+}
+
+// Skip one space separated field of a stat line, returns the start of the next one
+const char *skip_stat_field(const char *text)
+{
+    while (*text != ' ' && *text != '\0')
+    {
+        text++;
+    }
+    while (*text == ' ')
+    {
+        text++;
+    }
+    return text;
+}
+
+// Parse a decimal number and move the cursor past it, negative numbers included
+long long take_number(const char **cursor)
+{
+    const char *text = *cursor;
+    long long sign = 1;
+    long long number = 0;
+    if (*text == '-')
+    {
+        sign = -1;
+        text++;
+    }
+    while (*text >= '0' && *text <= '9')
+    {
+        number = number * 10 + (*text - '0');
+        text++;
+    }
+    *cursor = skip_stat_field(text);
+    return sign * number;
+}
+
+// Parse the text of /proc/<pid>/stat into an entry.
+// The name is wrapped in parentheses and may itself contain spaces and ')',
+// so everything after the name is found from the last ')' in the line.
+int parse_proc_stat(const char *text, struct proc_entry *entry)
+{
+    const char *open_paren = strchr(text, '(');
+    const char *close_paren = strrchr(text, ')');
+    if (open_paren == NULL || close_paren == NULL || close_paren < open_paren)
+    {
+        return 0;
+    }
+
+    // Field 2: name
+    int name_length = close_paren - open_paren - 1;
+    if (name_length > (int)sizeof(entry->comm) - 1)
+    {
+        name_length = sizeof(entry->comm) - 1;
+    }
+    memcpy(entry->comm, open_paren + 1, name_length);
+    entry->comm[name_length] = '\0';
+
+    const char *cursor = close_paren + 1;
+    while (*cursor == ' ')
+    {
+        cursor++;
+    }
+
+    // Fields 3 to 7: state, ppid, pgrp, session, tty_nr
+    entry->state = *cursor;
+    cursor = skip_stat_field(cursor);
+    entry->ppid = take_number(&cursor);
+    entry->pgrp = take_number(&cursor);
+    entry->session = take_number(&cursor);
+    entry->tty_nr = take_number(&cursor);
+
+    // Fields 8 to 13: tpgid, flags and fault counters, not needed
+    for (int field = 8; field <= 13; field++)
+    {
+        cursor = skip_stat_field(cursor);
+    }
+
+    // Fields 14 and 15: user and system time in clock ticks
+    entry->utime = take_number(&cursor);
+    entry->stime = take_number(&cursor);
+
+    // Fields 16 to 21: children times, priority, nice, threads, itrealvalue
+    for (int field = 16; field <= 21; field++)
+    {
+        cursor = skip_stat_field(cursor);
+    }
+
+    // Field 22: start time in clock ticks after boot
+    entry->start_time = take_number(&cursor);
+
+    // Field 23 is vsize, field 24 is the resident set size in pages
+    cursor = skip_stat_field(cursor);
+    entry->rss = take_number(&cursor);
+
+    return 1;
+}
+
+// Fill a table entry from the text of its stat file, links not set yet
+int fill_stat_entry(int pid, const char *stat, struct proc_entry *entry)
+{
+    entry->pid = pid;
+    entry->first_child = -1;
+    entry->next_sibling = -1;
+    entry->enter = -1;
+    entry->leave = -1;
+
+    return parse_proc_stat(stat, entry);
+}
+
+// Read every attribute we keep for one process from its stat file
+int read_stat_entry(int pid, struct proc_entry *entry)
+{
+    // The whole stat line fits easily, even with a long name
+    char stat[512];
+    if (read_proc_file(pid, 0, "stat", stat, sizeof(stat)) == -1)
+    {
+        return 0; // Process went away while we were scanning
+    }
+
+    return fill_stat_entry(pid, stat, entry);
+}
+
+// Look up a process in the snapshot, returns NULL if it is not there
+struct proc_entry *snapshot_lookup(int pid)
+{
+    if (pid <= 0 || pid > snapshot.max_pid || snapshot.index[pid] == -1)
+    {
+        return NULL;
+    }
+    return &snapshot.entries[snapshot.index[pid]];
+}
+
+// io_uring reader (--io-uring). Plain reads cost three system calls per stat
+// file: openat, read and close. Here each file becomes a chain of three linked
+// requests (open into a direct descriptor slot, read from that slot, close it)
+// and a whole batch of chains is submitted and reaped with one io_uring_enter.
+// The ring is set up with raw system calls; if the kernel or a seccomp filter
+// refuses it, the scanner quietly uses the plain reader.
+
+#define URING_BATCH 64      // Files per submission, three requests each
+#define URING_STAT_SIZE 512 // Same buffer size as read_stat_entry
+
+struct uring
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    long enters;            // io_uring_enter calls made, for the benchmark
+    char paths[URING_BATCH][24];
+};
+
+void uring_close(struct uring *ring)
+{
+    if (ring->sqes != NULL)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd != -1)
+    {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Set up a ring with URING_BATCH empty direct descriptor slots, returns 0 if
+// io_uring is not available to us
+int uring_open(struct uring *ring)
+{
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(SYS_io_uring_setup, URING_BATCH * 3, &params);
+    if (ring->fd == -1)
+    {
+        return 0; // ENOSYS, EPERM from seccomp or the io_uring_disabled sysctl
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+        {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        ring->sq_ring = NULL;
+        uring_close(ring);
+        return 0;
+    }
+    ring->cq_ring = ring->sq_ring;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+        {
+            ring->cq_ring = NULL;
+            uring_close(ring);
+            return 0;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        uring_close(ring);
+        return 0;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Empty slots for the files opened by the chains (-1 means unused)
+    int slots[URING_BATCH];
+    memset(slots, -1, sizeof(slots));
+    if (syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_FILES, slots, URING_BATCH) == -1)
+    {
+        uring_close(ring); // Kernel too old for direct descriptors
+        return 0;
+    }
+    return 1;
+}
+
+// Queue one request, the ring always has room because a batch fits it
+struct io_uring_sqe *uring_next_sqe(struct uring *ring, unsigned long long user_data)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+// Read the stat files of up to URING_BATCH processes. lengths[i] gets the
+// number of bytes read into stats[i], or -1 if the process is gone.
+// Returns 0 if the ring failed and the caller should read them itself.
+int uring_read_stats(struct uring *ring, const int *pids, int count, char (*stats)[URING_STAT_SIZE], int *lengths)
+{
+    for (int i = 0; i < count; i++)
+    {
+        char *end = put_number(ring->paths[i], pids[i]);
+        memcpy(end, "/stat", 6);
+        lengths[i] = -1;
+
+        // The open must succeed for the read to run; the close runs after the
+        // read whatever it returned, so the slot is always given back
+        struct io_uring_sqe *sqe = uring_next_sqe(ring, i * 3);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = get_proc_fd();
+        sqe->addr = (unsigned long)ring->paths[i];
+        sqe->open_flags = O_RDONLY; // Direct descriptors are never inherited, O_CLOEXEC is refused
+        sqe->file_index = i + 1;
+        sqe->flags = IOSQE_IO_LINK;
+
+        sqe = uring_next_sqe(ring, i * 3 + 1);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = i;
+        sqe->addr = (unsigned long)stats[i];
+        sqe->len = URING_STAT_SIZE - 1;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+
+        sqe = uring_next_sqe(ring, i * 3 + 2);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = i + 1;
+    }
+
+    // Submit everything and wait for every completion
+    int pending = count * 3;
+    int to_submit = pending;
+    while (pending > 0)
+    {
+        ring->enters++;
+        int submitted = syscall(SYS_io_uring_enter, ring->fd, to_submit, pending, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return 0;
+        }
+        to_submit -= submitted;
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->user_data % 3 == 1 && cqe->res >= 0)
+            {
+                int i = cqe->user_data / 3;
+                lengths[i] = cqe->res;
+                stats[i][cqe->res] = '\0';
+            }
+            pending--;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 1;
+}
+
+// Work handed to one scanner thread. Each thread only writes its own slice of
+// the entries table and its own children buffer, so no locking is needed.
+struct scan_worker
+{
+    pthread_t thread;
+    int started;                // 1 if the slice runs on its own thread
+    int *pids;                  // All PIDs listed in /proc
+    struct proc_entry *entries; // Output table shared by all threads
+    char *valid;                // valid[i] = 1 if entries[i] could be read
+    int start;                  // First PID position handled by this thread
+    int end;                    // One past the last PID position
+    int *children;              // Children PIDs of the whole slice, back to back
+    int children_count;
+    int children_capacity;
+    int *child_offset;          // Children of entries[i] start at child_offset[i - start]
+    double elapsed_ms;          // Wall time spent scanning the slice
+    struct arena memory;        // Holds the children buffer, one arena per thread
+};
+
+// Settings that can be changed with global flags
+int scan_threads = 0;       // Number of scanner threads, 0 means one per online CPU
+int show_scan_times = 0;    // Print how long each scanner thread took
+int show_stats = 0;         // Print memory use when the program exits
+int reconcile_seconds = 30; // Watch mode: seconds between full /proc rescans
+int batch_mode = 0;         // Answer from one snapshot and share tree answers between queries
+int live_index = 0;         // Watch and server mode: answer from the snapshot kept current by events
+int server_max_age_ms = 1000; // Query server: rescan older snapshots when kernel events are unavailable
+int history_slots = 3600;   // Sampling mode: samples kept per root
+int top_count = 10;         // -ru: subtrees to print
+int all_tasks = 0;          // Read the children of every thread, not only the main one
+int ppid_links = 0;         // Link processes by parent PID instead of reading children files
+int use_uring = 0;          // Read stat files through io_uring when the kernel allows it
+
+// Milliseconds from a monotonic clock, used for timing
+double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Add one child PID to the worker's children buffer
+void add_worker_child(struct scan_worker *worker, int child_pid)
+{
+    // Grow the buffer if it is full
+    if (worker->children_count == worker->children_capacity)
+    {
+        int new_capacity = worker->children_capacity ? worker->children_capacity * 2 : 256;
+        int *grown = arena_grow(&worker->memory, worker->children,
+                                worker->children_capacity * sizeof(int), new_capacity * sizeof(int));
+        if (grown == NULL)
+        {
+            return; // Keep what we have, this child is lost
+        }
+        worker->children = grown;
+        worker->children_capacity = new_capacity;
+    }
+    worker->children[worker->children_count++] = child_pid;
+}
+
+// Read an open children file into the worker's children buffer
+void read_children_fd(int fd, struct scan_worker *worker)
+{
+    // The list can be long (think of init), so read it in chunks and carry a
+    // number that is split between two chunks over to the next one
+    char chunk[4096];
+    int child_pid = 0;
+    int in_number = 0;
+    int length;
+
+    while ((length = read(fd, chunk, sizeof(chunk))) > 0)
+    {
+        for (int i = 0; i < length; i++)
+        {
+            if (chunk[i] >= '0' && chunk[i] <= '9')
+            {
+                child_pid = child_pid * 10 + (chunk[i] - '0');
+                in_number = 1;
+            }
+            else if (in_number)
+            {
+                add_worker_child(worker, child_pid);
+                child_pid = 0;
+                in_number = 0;
+            }
+        }
+    }
+    if (in_number)
+    {
+        add_worker_child(worker, child_pid);
+    }
+}
+
+// Directory entry as returned by the getdents64 system call
+struct task_dirent
+{
+    unsigned long long inode;
+    long long offset;
+    unsigned short length;
+    unsigned char type;
+    char name[];
+};
+
+// --all-tasks: the children of every thread of a process. The task directory
+// is opened once and each thread's children file is opened relative to it.
+// Every child belongs to exactly one thread, so the lists simply add up.
+void read_task_children(int pid, struct scan_worker *worker)
+{
+    char path[32];
+    char *end = put_number(path, pid);
+    memcpy(end, "/task", 6);
+    int task_fd = openat(get_proc_fd(), path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (task_fd == -1)
+    {
+        return;
+    }
+
+    // Room for a few hundred threads per system call, on the stack
+    char listing[8192] __attribute__((aligned(8)));
+    long length;
+    while ((length = syscall(SYS_getdents64, task_fd, listing, sizeof(listing))) > 0)
+    {
+        for (long offset = 0; offset < length;)
+        {
+            struct task_dirent *task = (struct task_dirent *)(listing + offset);
+            offset += task->length;
+            if (task->name[0] < '0' || task->name[0] > '9')
+            {
+                continue; // "." and ".."
+            }
+
+            int name_length = strlen(task->name);
+            if (name_length > 16)
+            {
+                continue;
+            }
+            memcpy(path, task->name, name_length);
+            memcpy(path + name_length, "/children", 10);
+            int fd = openat(task_fd, path, O_RDONLY | O_CLOEXEC);
+            if (fd != -1)
+            {
+                read_children_fd(fd, worker);
+                close(fd);
+            }
+        }
+    }
+    close(task_fd);
+}
+
+// Read the children file of one process into the worker's children buffer
+void read_children_file(int pid, struct scan_worker *worker)
+{
+    if (all_tasks)
+    {
+        read_task_children(pid, worker);
+        return;
+    }
+
+    int fd = open_proc_file(pid, pid, "children");
+    if (fd == -1)
+    {
+        return;
+    }
+    read_children_fd(fd, worker);
+    close(fd);
+}
+
+// Thread body: read status and children of every PID in the slice
+void *scan_worker_run(void *arg)
+{
+    struct scan_worker *worker = arg;
+    double started = now_ms();
+
+    // With --io-uring, read the stat files of the slice a batch at a time
+    struct uring ring;
+    int ringed = use_uring && uring_open(&ring);
+    char stats[URING_BATCH][URING_STAT_SIZE];
+    int lengths[URING_BATCH];
+
+    for (int batch = worker->start; batch < worker->end; batch += URING_BATCH)
+    {
+        int count = worker->end - batch < URING_BATCH ? worker->end - batch : URING_BATCH;
+        if (ringed && !uring_read_stats(&ring, &worker->pids[batch], count, stats, lengths))
+        {
+            uring_close(&ring); // Ring broke, the plain reader takes over
+            ringed = 0;
+        }
+
+        for (int i = batch; i < batch + count; i++)
+        {
+            worker->child_offset[i - worker->start] = worker->children_count;
+            if (ringed)
+            {
+                worker->valid[i] = lengths[i - batch] >= 0 && fill_stat_entry(worker->pids[i], stats[i - batch], &worker->entries[i]);
+            }
+            else
+            {
+                worker->valid[i] = read_stat_entry(worker->pids[i], &worker->entries[i]);
+            }
+            if (worker->valid[i] && !ppid_links)
+            {
+                read_children_file(worker->pids[i], worker);
+            }
+        }
+    }
+    if (ringed)
+    {
+        uring_close(&ring);
+    }
+    worker->child_offset[worker->end - worker->start] = worker->children_count;
+
+    worker->elapsed_ms = now_ms() - started;
+    return NULL;
+}
+
+// Link the children read by one worker into the final table
+void link_worker_children(struct scan_worker *worker, int *new_position)
+{
+    for (int i = worker->start; i < worker->end; i++)
+    {
+        if (!worker->valid[i])
+        {
+            continue;
+        }
+
+        struct proc_entry *parent = &snapshot.entries[new_position[i]];
+        int last_child = -1; // Keep the order of the children file
+
+        for (int c = worker->child_offset[i - worker->start]; c < worker->child_offset[i + 1 - worker->start]; c++)
+        {
+            struct proc_entry *child = snapshot_lookup(worker->children[c]);
+
+            // Skip children born after our scan, or already reparented
+            if (child == NULL || child->ppid != parent->pid)
+            {
+                continue;
+            }
+
+            int child_pos = child - snapshot.entries;
+            if (last_child == -1)
+            {
+                parent->first_child = child_pos;
+            }
+            else
+            {
+                snapshot.entries[last_child].next_sibling = child_pos;
+            }
+            last_child = child_pos;
+        }
+    }
+}
+
+// Link the table from the parent PIDs alone, for kernels built without the
+// children files (CONFIG_PROC_CHILDREN). A counting sort by parent position:
+// count the children of every entry, turn the counts into where each parent's
+// run ends, then drop every process into its parent's run from the back. Two
+// arrays, two passes over the table, and the children come out in PID order
+// just like the kernel's lists. Returns 0 if memory ran out.
+int link_by_parent(struct arena *scratch)
+{
+    int n = snapshot.count;
+    int *run_end = arena_alloc(scratch, (n + 1) * sizeof(int)); // run_end[p + 1] is where p's children end
+    int *by_parent = arena_alloc(scratch, (n + 1) * sizeof(int));
+    if (run_end == NULL || by_parent == NULL)
+    {
+        return 0;
+    }
+    memset(run_end, 0, (n + 1) * sizeof(int));
+
+    for (int i = 0; i < n; i++)
+    {
+        struct proc_entry *parent = snapshot_lookup(snapshot.entries[i].ppid);
+        if (parent != NULL && parent != &snapshot.entries[i])
+        {
+            run_end[parent - snapshot.entries + 1]++;
+        }
+    }
+    for (int p = 1; p <= n; p++)
+    {
+        run_end[p] += run_end[p - 1];
+    }
+    int linked = run_end[n];
+
+    // Filling from the back leaves run_end[p + 1] at the start of p's run
+    for (int i = n - 1; i >= 0; i--)
+    {
+        struct proc_entry *parent = snapshot_lookup(snapshot.entries[i].ppid);
+        if (parent != NULL && parent != &snapshot.entries[i])
+        {
+            by_parent[--run_end[parent - snapshot.entries + 1]] = i;
+        }
+    }
+
+    for (int p = 0; p < n; p++)
+    {
+        int end = p + 1 < n ? run_end[p + 2] : linked;
+        int last_child = -1;
+        for (int k = run_end[p + 1]; k < end; k++)
+        {
+            if (last_child == -1)
+            {
+                snapshot.entries[p].first_child = by_parent[k];
+            }
+            else
+            {
+                snapshot.entries[last_child].next_sibling = by_parent[k];
+            }
+            last_child = by_parent[k];
+        }
+    }
+    return 1;
+}
+
+// Free the snapshot so it can be built again
+void snapshot_free(void)
+{
+    if (snapshot.mapping != NULL)
+    {
+        munmap(snapshot.mapping, snapshot.mapping_size);
+        if (columns.mapped)
+        {
+            memset(&columns, 0, sizeof(columns));
+        }
+    }
+    arena_free(&snapshot.memory);
+    memset(&snapshot, 0, sizeof(snapshot));
+}
+
+// Snapshot files. prct --save writes the table exactly as it sits in memory,
+// plus the PID index, the tour columns and a pool of command lines, each
+// section aligned to 64 bytes. --from maps such a file and points the snapshot
+// straight at it, so loading costs one mmap() and no parsing. The table layout
+// is only valid on machines with the same struct layout and byte order, which
+// the header records and the loader checks.
+#define SNAPSHOT_MAGIC "PRCTSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+#define SNAPSHOT_ALIGN 64
+
+struct snapshot_file_header
+{
+    char magic[8];             // SNAPSHOT_MAGIC
+    uint32_t version;          // SNAPSHOT_VERSION
+    uint32_t byte_order;       // SNAPSHOT_BYTE_ORDER as the writer stored it
+    uint32_t entry_size;       // sizeof(struct proc_entry) of the writer
+    uint32_t long_size;        // sizeof(long) of the writer
+    int32_t count;             // Processes in the table
+    int32_t max_pid;           // Largest PID in the index
+    int32_t column_count;      // Filled tour column slots, the rest are zero
+    int64_t saved_at;          // time() when the file was written
+    uint64_t entries_offset;   // struct proc_entry[count], links and tour numbers included
+    uint64_t index_offset;     // int32_t[max_pid + 1], table position of each PID or -1
+    uint64_t pid_offset;       // Tour columns, count slots each
+    uint64_t ppid_offset;
+    uint64_t state_offset;
+    uint64_t rss_offset;
+    uint64_t leave_offset;
+    uint64_t cmdline_offset;   // uint32_t[count + 1]: start of each process' command line in the pool
+    uint64_t pool_offset;      // Command lines, back to back
+    uint64_t pool_size;
+    uint64_t file_size;
+};
+
+// Which snapshot file to answer from, NULL to scan /proc (--from)
+const char *snapshot_file = NULL;
+
+// Round a file offset up to the next section boundary
+uint64_t snapshot_align(uint64_t offset)
+{
+    return (offset + SNAPSHOT_ALIGN - 1) & ~(uint64_t)(SNAPSHOT_ALIGN - 1);
+}
+
+// Check that a section lies inside the file and starts on a section boundary
+int section_fits(struct snapshot_file_header *header, uint64_t offset, uint64_t size)
+{
+    return offset % SNAPSHOT_ALIGN == 0 && offset <= header->file_size && size <= header->file_size - offset;
+}
+
+// The loader trusts nothing in the file that is later used as an array index:
+// every link, tour number and index slot must point inside the table, the
+// PID index and the table must agree, and the child links must form a forest
+// (nothing is linked twice and there are no cycles), so no walk can leave
+// the mapping or loop forever. Returns 0 if the file is damaged.
+int snapshot_indexes_valid(struct snapshot_file_header *header, char *base)
+{
+    struct proc_entry *entries = (struct proc_entry *)(base + header->entries_offset);
+    int *index = (int *)(base + header->index_offset);
+    int *tour_pids = (int *)(base + header->pid_offset);
+    int *tour_leave = (int *)(base + header->leave_offset);
+    int count = header->count;
+    int column_count = header->column_count;
+
+    // How many links point at each entry, and a stack for the cycle check
+    char *linked = calloc(count + 1, 1);
+    int *stack = malloc((count + 1) * sizeof(int));
+    int ok = linked != NULL && stack != NULL;
+
+    for (int i = 0; ok && i < count; i++)
+    {
+        struct proc_entry *entry = &entries[i];
+        ok = entry->pid >= 0 && entry->pid <= header->max_pid &&
+             entry->first_child >= -1 && entry->first_child < count &&
+             entry->next_sibling >= -1 && entry->next_sibling < count;
+        if (ok && entry->enter != -1)
+        {
+            ok = entry->enter >= 0 && entry->enter <= entry->leave && entry->leave < column_count &&
+                 tour_pids[entry->enter] == entry->pid;
+        }
+        if (ok && entry->first_child != -1)
+        {
+            ok = ++linked[entry->first_child] == 1;
+        }
+        if (ok && entry->next_sibling != -1)
+        {
+            ok = ++linked[entry->next_sibling] == 1;
+        }
+    }
+    for (int pid = 0; ok && pid <= header->max_pid; pid++)
+    {
+        ok = index[pid] >= -1 && index[pid] < count && (index[pid] == -1 || entries[index[pid]].pid == pid);
+    }
+    for (int slot = 0; ok && slot < column_count; slot++)
+    {
+        ok = tour_leave[slot] >= slot && tour_leave[slot] < column_count;
+    }
+
+    // Nothing is linked twice, so walking down from the unlinked entries
+    // reaches every entry exactly once unless some of them form a cycle
+    int reached = 0;
+    for (int i = 0; ok && i < count; i++)
+    {
+        if (linked[i] != 0)
+        {
+            continue;
+        }
+        int depth = 0;
+        stack[depth++] = i;
+        while (depth > 0)
+        {
+            struct proc_entry *entry = &entries[stack[--depth]];
+            reached++;
+            if (entry->first_child != -1)
+            {
+                stack[depth++] = entry->first_child;
+            }
+            if (entry->next_sibling != -1)
+            {
+                stack[depth++] = entry->next_sibling;
+            }
+        }
+    }
+    ok = ok && reached == count;
+
+    free(stack);
+    free(linked);
+    return ok;
+}
+
+// Map a snapshot file and make it the current snapshot, returns 0 on error
+int snapshot_load(const char *path)
+{
+    snapshot_free();
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) == -1)
+    {
+        perror(path);
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return 0;
+    }
+
+    // Private and writable: tour numbers and watch mode edits stay in our copy
+    void *mapping = NULL;
+    if ((size_t)info.st_size >= sizeof(struct snapshot_file_header))
+    {
+        mapping = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapping == NULL || mapping == MAP_FAILED)
+    {
+        printf("ERROR:%s is not a snapshot file\n", path);
+        return 0;
+    }
+
+    struct snapshot_file_header *header = mapping;
+    const char *problem = NULL;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, 8) != 0)
+    {
+        problem = "is not a snapshot file";
+    }
+    else if (header->version != SNAPSHOT_VERSION)
+    {
+        problem = "was written by another version of prct";
+    }
+    else if (header->byte_order != SNAPSHOT_BYTE_ORDER || header->entry_size != sizeof(struct proc_entry) ||
+             header->long_size != sizeof(long))
+    {
+        problem = "was written on a machine with a different layout";
+    }
+    else if (header->file_size != (uint64_t)info.st_size || header->count < 0 || header->max_pid < 0 ||
+             header->column_count < 0 || header->column_count > header->count ||
+             !section_fits(header, header->entries_offset, (uint64_t)header->count * sizeof(struct proc_entry)) ||
+             !section_fits(header, header->index_offset, ((uint64_t)header->max_pid + 1) * sizeof(int)) ||
+             !section_fits(header, header->pid_offset, (uint64_t)header->count * sizeof(int)) ||
+             !section_fits(header, header->ppid_offset, (uint64_t)header->count * sizeof(int)) ||
+             !section_fits(header, header->state_offset, (uint64_t)header->count) ||
+             !section_fits(header, header->rss_offset, (uint64_t)header->count * sizeof(long)) ||
+             !section_fits(header, header->leave_offset, (uint64_t)header->count * sizeof(int)) ||
+             !section_fits(header, header->cmdline_offset, ((uint64_t)header->count + 1) * sizeof(uint32_t)) ||
+             !section_fits(header, header->pool_offset, header->pool_size))
+    {
+        problem = "is truncated or damaged";
+    }
+    else if (!snapshot_indexes_valid(header, mapping))
+    {
+        problem = "is damaged: its process links do not fit its table";
+    }
+    if (problem != NULL)
+    {
+        printf("ERROR:%s %s\n", path, problem);
+        munmap(mapping, info.st_size);
+        return 0;
+    }
+
+    char *base = mapping;
+    snapshot.mapping = mapping;
+    snapshot.mapping_size = info.st_size;
+    snapshot.entries = (struct proc_entry *)(base + header->entries_offset);
+    snapshot.count = header->count;
+    snapshot.capacity = header->count;
+    snapshot.index = (int *)(base + header->index_offset);
+    snapshot.max_pid = header->max_pid;
+    snapshot.free_slot = -1;
+    snapshot.loaded = 1;
+    snapshot.built_ms = now_ms();
+    tree_generation++;
+
+    // The tour was numbered before saving, so the columns are ready to use
+    if (columns.mapped)
+    {
+        memset(&columns, 0, sizeof(columns));
+    }
+    free(columns.pid);
+    free(columns.ppid);
+    free(columns.state);
+    free(columns.rss);
+    free(columns.leave);
+    columns.pid = (int *)(base + header->pid_offset);
+    columns.ppid = (int *)(base + header->ppid_offset);
+    columns.state = base + header->state_offset;
+    columns.rss = (long *)(base + header->rss_offset);
+    columns.leave = (int *)(base + header->leave_offset);
+    columns.count = header->column_count;
+    columns.capacity = header->count;
+    columns.mapped = 1;
+    tour_generation = tree_generation;
+    return 1;
+}
+
+// Command line of a process (NUL separated arguments), from the snapshot file
+// when there is one and from /proc otherwise. Returns its length, -1 on error.
+int read_cmdline(int pid, char *buf, int size)
+{
+    if (snapshot.mapping == NULL)
+    {
+        return read_proc_file(pid, 0, "cmdline", buf, size);
+    }
+
+    struct snapshot_file_header *header = snapshot.mapping;
+    struct proc_entry *entry = snapshot_lookup(pid);
+    if (entry == NULL)
+    {
+        return -1;
+    }
+    const uint32_t *starts = (const uint32_t *)((char *)snapshot.mapping + header->cmdline_offset);
+    int position = entry - snapshot.entries;
+    uint32_t start = starts[position];
+    uint32_t end = starts[position + 1];
+    if (start > end || end > header->pool_size)
+    {
+        return -1;
+    }
+
+    int length = end - start;
+    if (length > size - 1)
+    {
+        length = size - 1;
+    }
+    memcpy(buf, (char *)snapshot.mapping + header->pool_offset + start, length);
+    buf[length] = '\0';
+    return length;
+}
+
+// List all numeric entries of /proc into an arena, returns the number of PIDs found
+int list_proc_pids(struct arena *memory, int **pids_out)
+{
+    DIR *proc_dir = opendir("/proc");
+    if (proc_dir == NULL)
+    {
+        perror("Cannot open /proc");
+        return -1;
+    }
+
+    int *pids = NULL;
+    int count = 0;
+    int capacity = 0;
+
+    struct dirent *dir_entry;
+    while ((dir_entry = readdir(proc_dir)) != NULL)
+    {
+        // Only directories with a numeric name are processes
+        char *name = dir_entry->d_name;
+        if (name[0] < '1' || name[0] > '9')
+        {
+            continue;
+        }
+
+        if (count == capacity)
+        {
+            int new_capacity = capacity ? capacity * 2 : 1024;
+            int *grown = arena_grow(memory, pids, capacity * sizeof(int), new_capacity * sizeof(int));
+            if (grown == NULL)
+            {
+                perror("Out of memory while scanning /proc");
+                closedir(proc_dir);
+                return -1;
+            }
+            pids = grown;
+            capacity = new_capacity;
+        }
+        pids[count++] = atoi(name);
+    }
+    closedir(proc_dir);
+
+    *pids_out = pids;
+    return count;
+}
+
+// Decide how many scanner threads to use for a given number of PIDs
+int pick_scan_threads(int pid_count)
+{
+    int threads = scan_threads;
+    if (threads <= 0)
+    {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    // Don't start threads that would only get a handful of PIDs each
+    int most_useful = pid_count / 64 + 1;
+    if (threads > most_useful)
+    {
+        threads = most_useful;
+    }
+    return threads < 1 ? 1 : threads;
+}
+
+// Kernels built without CONFIG_PROC_CHILDREN have no children files at all.
+// Our own main thread always has one otherwise, so one open tells us.
+int children_files_missing(void)
+{
+    static int missing = -1;
+    if (missing == -1)
+    {
+        int fd = open_proc_file(getpid(), getpid(), "children");
+        missing = fd == -1 && errno == ENOENT;
+        if (fd != -1)
+        {
+            close(fd);
+        }
+    }
+    return missing;
+}
+
+// Scan /proc once and fill the snapshot table, splitting the work across threads
+int snapshot_build(void)
+{
+    // Answer from a saved snapshot instead of /proc
+    if (snapshot_file != NULL)
+    {
+        return snapshot_load(snapshot_file);
+    }
+
+    snapshot_free();
+
+    // Open /proc before any thread starts so they all share one fd
+    if (get_proc_fd() == -1)
+    {
+        perror("Cannot open /proc");
+        return 0;
+    }
+
+    // Without children files every process would look childless
+    if (!ppid_links && children_files_missing())
+    {
+        ppid_links = 1;
+    }
+
+    // Everything only needed while scanning goes into one scratch arena
+    struct arena scratch = {0};
+    int *pids;
+    int pid_count = list_proc_pids(&scratch, &pids);
+    if (pid_count < 0)
+    {
+        arena_free(&scratch);
+        return 0;
+    }
+
+    int thread_count = pick_scan_threads(pid_count);
+
+    struct proc_entry *entries = arena_alloc(&snapshot.memory, (pid_count + 1) * sizeof(struct proc_entry));
+    char *valid = arena_alloc(&scratch, pid_count + 1);
+    int *new_position = arena_alloc(&scratch, (pid_count + 1) * sizeof(int));
+    int *child_offsets = arena_alloc(&scratch, (pid_count + thread_count) * sizeof(int));
+    struct scan_worker *workers = arena_alloc(&scratch, thread_count * sizeof(struct scan_worker));
+    if (entries == NULL || valid == NULL || new_position == NULL || child_offsets == NULL || workers == NULL)
+    {
+        perror("Out of memory while scanning /proc");
+        arena_free(&scratch);
+        snapshot_free();
+        return 0;
+    }
+    memset(valid, 0, pid_count + 1);
+    memset(workers, 0, thread_count * sizeof(struct scan_worker));
+
+    // Give every thread a contiguous slice of the PID list
+    for (int t = 0; t < thread_count; t++)
+    {
+        struct scan_worker *worker = &workers[t];
+        worker->pids = pids;
+        worker->entries = entries;
+        worker->valid = valid;
+        worker->start = (int)((long)pid_count * t / thread_count);
+        worker->end = (int)((long)pid_count * (t + 1) / thread_count);
+        worker->child_offset = child_offsets + worker->start + t; // One extra slot per slice
+    }
+
+    // Thread 0 is the calling thread, the others are started here
+    for (int t = 1; t < thread_count; t++)
+    {
+        workers[t].started = pthread_create(&workers[t].thread, NULL, scan_worker_run, &workers[t]) == 0;
+    }
+    scan_worker_run(&workers[0]);
+    for (int t = 1; t < thread_count; t++)
+    {
+        if (!workers[t].started)
+        {
+            scan_worker_run(&workers[t]); // Could not start a thread, do it ourselves
+        }
+    }
+    for (int t = 1; t < thread_count; t++)
+    {
+        if (workers[t].started)
+        {
+            pthread_join(workers[t].thread, NULL);
+        }
+    }
+
+    // Pack the entries we could read to the front of the table
+    snapshot.entries = entries;
+    snapshot.capacity = pid_count + 1;
+    for (int i = 0; i < pid_count; i++)
+    {
+        if (!valid[i])
+        {
+            continue;
+        }
+        new_position[i] = snapshot.count;
+        entries[snapshot.count++] = entries[i];
+        if (entries[i].pid > snapshot.max_pid)
+        {
+            snapshot.max_pid = entries[i].pid;
+        }
+    }
+
+    // Build the PID index so lookups don't need any searching
+    snapshot.index = arena_alloc(&snapshot.memory, (snapshot.max_pid + 1) * sizeof(int));
+    if (snapshot.index == NULL)
+    {
+        perror("Out of memory while indexing /proc");
+    }
+    else
+    {
+        memset(snapshot.index, -1, (snapshot.max_pid + 1) * sizeof(int));
+        for (int i = 0; i < snapshot.count; i++)
+        {
+            snapshot.index[snapshot.entries[i].pid] = i;
+        }
+
+        // Now that every PID can be found, merge the children each thread read,
+        // or invert the parent PIDs when there are no children files
+        if (ppid_links)
+        {
+            if (!link_by_parent(&scratch))
+            {
+                perror("Out of memory while linking /proc");
+            }
+        }
+        else
+        {
+            for (int t = 0; t < thread_count; t++)
+            {
+                link_worker_children(&workers[t], new_position);
+            }
+        }
+        snapshot.free_slot = -1;
+        snapshot.loaded = 1;
+        snapshot.built_ms = now_ms();
+        tree_generation++;
+    }
+
+    if (show_scan_times)
+    {
+        for (int t = 0; t < thread_count; t++)
+        {
+            fprintf(stderr, "Scan thread %d: %d processes in %.3f ms\n",
+                    t, workers[t].end - workers[t].start, workers[t].elapsed_ms);
+        }
+    }
+
+    for (int t = 0; t < thread_count; t++)
+    {
+        arena_free(&workers[t].memory);
+    }
+    arena_free(&scratch);
+
+    return snapshot.loaded;
+}
+
+// --stats: memory used by the snapshot and by the whole program, printed at exit
+void print_stats(void)
+{
+    long snapshot_bytes = 0;
+    int snapshot_blocks = 0;
+    for (struct arena_block *block = snapshot.memory.blocks; block != NULL; block = block->next)
+    {
+        snapshot_bytes += ARENA_HEADER + block->size;
+        snapshot_blocks++;
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    output_flush();
+    fprintf(stderr, "Snapshot: %d processes in %ld KB (%d arena blocks)\n",
+            snapshot.count, snapshot_bytes / 1024, snapshot_blocks);
+    fprintf(stderr, "Allocations: %ld from arenas, %ld heap blocks taken by arenas (%ld KB)\n",
+            arena_allocations, arena_heap_blocks, arena_heap_bytes / 1024);
+    fprintf(stderr, "Peak RSS: %ld KB\n", usage.ru_maxrss);
+}
+
+// Find a process, building the snapshot on first use
+struct proc_entry *find_process(int pid)
+{
+    if (!snapshot.loaded)
+    {
+        snapshot_build();
+    }
+    return snapshot_lookup(pid);
+}
+
+// Get the first child of a process from the snapshot, NULL if it has none
+struct proc_entry *first_child_of(struct proc_entry *entry)
+{
+    return entry->first_child == -1 ? NULL : &snapshot.entries[entry->first_child];
+}
+
+// Get the next sibling of a process from the snapshot, NULL if it was the last
+struct proc_entry *next_sibling_of(struct proc_entry *entry)
+{
+    return entry->next_sibling == -1 ? NULL : &snapshot.entries[entry->next_sibling];
+}
+
+// Change the state of a process. The links stay the same, so the tour numbers
+// are still good: patch its slot in the state column instead of renumbering.
+void snapshot_set_state(struct proc_entry *entry, char state)
+{
+    entry->state = state;
+    if (tour_generation == tree_generation && entry->enter >= 0 && entry->enter < columns.count)
+    {
+        columns.state[entry->enter] = state;
+    }
+}
+
+// Take a process out of its parent's list of children
+void snapshot_unlink(int position)
+{
+    struct proc_entry *entry = &snapshot.entries[position];
+    struct proc_entry *parent = snapshot_lookup(entry->ppid);
+    if (parent == NULL)
+    {
+        return;
+    }
+
+    // Find the link that points at us and make it skip us
+    int *link = &parent->first_child;
+    while (*link != -1 && *link != position)
+    {
+        link = &snapshot.entries[*link].next_sibling;
+    }
+    if (*link == position)
+    {
+        *link = entry->next_sibling;
+    }
+    entry->next_sibling = -1;
+    tree_generation++;
+}
+
+// Put a process at the end of its parent's list of children
+void snapshot_link(int position)
+{
+    struct proc_entry *entry = &snapshot.entries[position];
+    struct proc_entry *parent = snapshot_lookup(entry->ppid);
+    entry->next_sibling = -1;
+    tree_generation++;
+    if (parent == NULL)
+    {
+        return;
+    }
+
+    int *link = &parent->first_child;
+    while (*link != -1)
+    {
+        link = &snapshot.entries[*link].next_sibling;
+    }
+    *link = position;
+}
+
+// Make sure the PID index can hold a PID, returns 0 if memory ran out
+int snapshot_grow_index(int pid)
+{
+    if (pid <= snapshot.max_pid)
+    {
+        return 1;
+    }
+
+    int new_max = snapshot.max_pid ? snapshot.max_pid : 1024;
+    while (new_max < pid)
+    {
+        new_max *= 2;
+    }
+    int *grown = arena_grow(&snapshot.memory, snapshot.index,
+                            (snapshot.max_pid + 1) * sizeof(int), (new_max + 1) * sizeof(int));
+    if (grown == NULL)
+    {
+        return 0;
+    }
+    memset(grown + snapshot.max_pid + 1, -1, (new_max - snapshot.max_pid) * sizeof(int));
+    snapshot.index = grown;
+    snapshot.max_pid = new_max;
+    return 1;
+}
+
+// Remove a process from a loaded snapshot. Its children, if it still has any,
+// are moved to whatever parent /proc says they have now.
+void snapshot_remove(int pid)
+{
+    struct proc_entry *entry = snapshot_lookup(pid);
+    if (entry == NULL)
+    {
+        return;
+    }
+    int position = entry - snapshot.entries;
+
+    snapshot_unlink(position);
+
+    // Hand the children over to their new parent
+    int child = entry->first_child;
+    entry->first_child = -1;
+    while (child != -1)
+    {
+        int next = snapshot.entries[child].next_sibling;
+        struct proc_entry now;
+        snapshot.entries[child].ppid = read_stat_entry(snapshot.entries[child].pid, &now) ? now.ppid : 1;
+        snapshot_link(child);
+        child = next;
+    }
+
+    // Leave an empty slot behind and remember it for the next new process
+    snapshot.index[pid] = -1;
+    entry->pid = 0;
+    entry->state = 0;
+    entry->next_sibling = snapshot.free_slot;
+    snapshot.free_slot = position;
+}
+
+// Add a new process to a loaded snapshot, reading its details from /proc.
+// Returns 0 if the process is already gone.
+int snapshot_add(int pid)
+{
+    struct proc_entry fresh;
+    if (!read_stat_entry(pid, &fresh))
+    {
+        return 0;
+    }
+
+    // Our copy of a recycled PID is stale, drop it first
+    snapshot_remove(pid);
+    if (!snapshot_grow_index(pid))
+    {
+        return 0;
+    }
+
+    // Reuse an empty slot if there is one, grow the table otherwise
+    int position = snapshot.free_slot;
+    if (position != -1)
+    {
+        snapshot.free_slot = snapshot.entries[position].next_sibling;
+    }
+    else
+    {
+        if (snapshot.count == snapshot.capacity)
+        {
+            int new_capacity = snapshot.capacity ? snapshot.capacity * 2 : 1024;
+            struct proc_entry *grown = arena_grow(&snapshot.memory, snapshot.entries,
+                                                  snapshot.capacity * sizeof(struct proc_entry),
+                                                  new_capacity * sizeof(struct proc_entry));
+            if (grown == NULL)
+            {
+                return 0;
+            }
+            snapshot.entries = grown;
+            snapshot.capacity = new_capacity;
+        }
+        position = snapshot.count++;
+    }
+
+    snapshot.entries[position] = fresh;
+    snapshot.index[pid] = position;
+    snapshot_link(position);
+    return 1;
+}
+
+// Re-read the parent of a process and move it if it has been reparented
+void snapshot_refresh_parent(int pid)
+{
+    struct proc_entry *entry = snapshot_lookup(pid);
+    struct proc_entry now;
+    if (entry == NULL || !read_stat_entry(pid, &now))
+    {
+        return;
+    }
+
+    snapshot_set_state(entry, now.state);
+    if (now.ppid != entry->ppid)
+    {
+        int position = entry - snapshot.entries;
+        snapshot_unlink(position);
+        entry->ppid = now.ppid;
+        snapshot_link(position);
+    }
+}
+
+// Ways the traversal engine can walk a subtree, combine them with |
+#define WALK_PRE 1          // Call the visitor before the descendants of a process
+#define WALK_POST 2         // Call the visitor after all descendants of a process
+#define WALK_BFS 4          // Go level by level (breadth first) instead of depth first
+#define WALK_INCLUDE_ROOT 8 // Visit the root process too, not only its descendants
+
+// What the traversal engine tells the visitor about each process
+struct walk_step
+{
+    struct proc_entry *entry; // The process being visited
+    int depth;                // 0 for the root, 1 for its children, ...
+    int order;                // WALK_PRE or WALK_POST, whichever visit this is
+};
+
+// Called for every visited process, return non-zero to stop the walk
+typedef int (*walk_visitor)(struct walk_step *step, void *context);
+
+// One pending process on the engine's stack or queue
+struct walk_item
+{
+    int position; // Table index of the process
+    int depth;    // Depth below the root
+    int expanded; // Depth first only: 1 once its children have been pushed
+};
+
+// Growable stack or queue used by the traversal engine
+struct walk_list
+{
+    struct walk_item *items;
+    int count;
+    int capacity;
+};
+
+// Add a process to the stack or queue, returns 0 if we ran out of memory
+int walk_push(struct walk_list *list, int position, int depth)
+{
+    if (list->count == list->capacity)
+    {
+        int new_capacity = list->capacity ? list->capacity * 2 : 64;
+        struct walk_item *grown = realloc(list->items, new_capacity * sizeof(struct walk_item));
+        if (grown == NULL)
+        {
+            write_text("Out of memory while walking the process tree\n");
+            return 0;
+        }
+        list->items = grown;
+        list->capacity = new_capacity;
+    }
+
+    list->items[list->count].position = position;
+    list->items[list->count].depth = depth;
+    list->items[list->count].expanded = 0;
+    list->count++;
+    return 1;
+}
+
+// Call the visitor for one process, returns non-zero if the walk should stop
+int walk_visit(walk_visitor visit, void *context, int position, int depth, int order)
+{
+    struct walk_step step;
+    step.entry = &snapshot.entries[position];
+    step.depth = depth;
+    step.order = order;
+    return visit(&step, context);
+}
+
+// Depth first walk. The stack only holds the path from the root to the current
+// process, so memory grows with the depth of the tree, not with its size.
+void walk_depth_first(struct proc_entry *root, int flags, walk_visitor visit, void *context)
+{
+    struct walk_list stack = {0};
+    int root_position = root - snapshot.entries;
+    int ok = 1;
+
+    if (flags & WALK_INCLUDE_ROOT)
+    {
+        ok = walk_push(&stack, root_position, 0);
+    }
+    else if (root->first_child != -1)
+    {
+        ok = walk_push(&stack, root->first_child, 1);
+    }
+
+    while (ok && stack.count > 0)
+    {
+        struct walk_item *top = &stack.items[stack.count - 1];
+        int position = top->position;
+        int depth = top->depth;
+        struct proc_entry *entry = &snapshot.entries[position];
+
+        if (!top->expanded)
+        {
+            // First time we see this process: visit it and go down to its children
+            top->expanded = 1;
+            if ((flags & WALK_PRE) && walk_visit(visit, context, position, depth, WALK_PRE))
+            {
+                break;
+            }
+            if (entry->first_child != -1)
+            {
+                ok = walk_push(&stack, entry->first_child, depth + 1);
+            }
+            continue;
+        }
+
+        // All descendants are done: visit it and move on to its next sibling
+        stack.count--;
+        if ((flags & WALK_POST) && walk_visit(visit, context, position, depth, WALK_POST))
+        {
+            break;
+        }
+        if (position != root_position && entry->next_sibling != -1)
+        {
+            ok = walk_push(&stack, entry->next_sibling, depth);
+        }
+    }
+
+    free(stack.items);
+}
+
+// Breadth first walk. Post-order visits go through the queue backwards, so the
+// deepest level comes first and every process comes after its descendants.
+void walk_breadth_first(struct proc_entry *root, int flags, walk_visitor visit, void *context)
+{
+    struct walk_list queue = {0};
+    int ok = 1;
+
+    if (flags & WALK_INCLUDE_ROOT)
+    {
+        ok = walk_push(&queue, root - snapshot.entries, 0);
+    }
+    else
+    {
+        for (int child = root->first_child; ok && child != -1; child = snapshot.entries[child].next_sibling)
+        {
+            ok = walk_push(&queue, child, 1);
+        }
+    }
+
+    int stopped = 0;
+    for (int head = 0; ok && head < queue.count; head++)
+    {
+        int position = queue.items[head].position;
+        int depth = queue.items[head].depth;
+
+        if ((flags & WALK_PRE) && walk_visit(visit, context, position, depth, WALK_PRE))
+        {
+            stopped = 1;
+            break;
+        }
+        for (int child = snapshot.entries[position].first_child; ok && child != -1; child = snapshot.entries[child].next_sibling)
+        {
+            ok = walk_push(&queue, child, depth + 1);
+        }
+    }
+
+    if (ok && !stopped && (flags & WALK_POST))
+    {
+        for (int i = queue.count - 1; i >= 0; i--)
+        {
+            if (walk_visit(visit, context, queue.items[i].position, queue.items[i].depth, WALK_POST))
+            {
+                break;
+            }
+        }
+    }
+
+    free(queue.items);
+}
+
+// Walk the subtree below a process without recursion and without keeping any
+// file open. Returns 0 if the root process is not in the snapshot.
+int walk_subtree(int root_pid, int flags, walk_visitor visit, void *context)
+{
+    struct proc_entry *root = find_process(root_pid);
+    if (root == NULL)
+    {
+        return 0;
+    }
+
+    if (flags & WALK_BFS)
+    {
+        walk_breadth_first(root, flags, visit, context);
+    }
+    else
+    {
+        walk_depth_first(root, flags, visit, context);
+    }
+    return 1;
+}
+
+// Function to check if process exists or not
+int does_process_exist(int pid)
+{
+    // Batch, watch and server mode and snapshot files answer every query from the snapshot
+    if (batch_mode || live_index || snapshot_file != NULL)
+    {
+        return find_process(pid) != NULL;
+    }
+
+    // Try to open the status file, like "/proc/1234/status"
+    int fd = open_proc_file(pid, 0, "status");
+    if (fd == -1)
+    {
+        return 0; // File didn't open, so process doesn't exist
+    }
+
+    // If we got here, file opened okay
+    close(fd);
+
+    // Process exists
+    return 1;
+}
+
+// Function to get pid of the parent process
+int get_parent_pid(int pid)
+{
+    // Look the process up in the snapshot
+    struct proc_entry *entry = find_process(pid);
+
+    // Check if we know about this process
+    if (entry == NULL)
+    {
+        write_text("Cannot open status file for process %d\n", pid);
+        return -1; // Return -1 if the process is not in the snapshot
+    }
+
+    // Return the parent pid we found
+    return entry->ppid;
+}
+
+
+// Make room for one slot per process in the table, returns 0 if memory ran out
+int columns_reserve(int count)
+{
+    if (count <= columns.capacity)
+    {
+        return 1;
+    }
+    if (columns.mapped)
+    {
+        memset(&columns, 0, sizeof(columns)); // Never realloc() a file mapping
+    }
+
+    int *pid = realloc(columns.pid, count * sizeof(int));
+    if (pid != NULL)
+    {
+        columns.pid = pid;
+    }
+    int *ppid = realloc(columns.ppid, count * sizeof(int));
+    if (ppid != NULL)
+    {
+        columns.ppid = ppid;
+    }
+    char *state = realloc(columns.state, count);
+    if (state != NULL)
+    {
+        columns.state = state;
+    }
+    long *rss = realloc(columns.rss, count * sizeof(long));
+    if (rss != NULL)
+    {
+        columns.rss = rss;
+    }
+    int *leave = realloc(columns.leave, count * sizeof(int));
+    if (leave != NULL)
+    {
+        columns.leave = leave;
+    }
+    if (pid == NULL || ppid == NULL || state == NULL || rss == NULL || leave == NULL)
+    {
+        return 0;
+    }
+    columns.capacity = count;
+    return 1;
+}
+
+int tour_visitor(struct walk_step *step, void *context)
+{
+    int *next_number = context;
+    if (step->order == WALK_PRE)
+    {
+        int slot = (*next_number)++;
+        step->entry->enter = slot;
+        columns.pid[slot] = step->entry->pid;
+        columns.ppid[slot] = step->entry->ppid;
+        columns.state[slot] = step->entry->state;
+        columns.rss[slot] = step->entry->rss;
+    }
+    else
+    {
+        step->entry->leave = *next_number - 1;
+        columns.leave[step->entry->enter] = step->entry->leave;
+    }
+    return 0;
+}
+
+// Number the snapshot if the links changed since the last time.
+// Returns 0 if there is no snapshot to number.
+int tour_ready(void)
+{
+    if (!snapshot.loaded && !snapshot_build())
+    {
+        return 0;
+    }
+    if (tour_generation == tree_generation)
+    {
+        return 1;
+    }
+
+    if (!columns_reserve(snapshot.count))
+    {
+        fprintf(stderr, "Out of memory while numbering the process tree\n");
+        return 0;
+    }
+    for (int i = 0; i < snapshot.count; i++)
+    {
+        snapshot.entries[i].enter = -1;
+        snapshot.entries[i].leave = -1;
+    }
+
+    // Start from every process whose parent we do not have (init, kthreadd, ...)
+    int next_number = 0;
+    for (int i = 0; i < snapshot.count; i++)
+    {
+        struct proc_entry *entry = &snapshot.entries[i];
+        if (entry->pid != 0 && snapshot_lookup(entry->ppid) == NULL)
+        {
+            walk_subtree(entry->pid, WALK_PRE | WALK_POST | WALK_INCLUDE_ROOT, tour_visitor, &next_number);
+        }
+    }
+
+    columns.count = next_number;
+    tour_generation = tree_generation;
+    return 1;
+}
+
+// State scan kernels. Each one looks at a run of the state column: count
+// counts the bytes equal to a state letter, find returns the offset of the
+// first one (or length if there is none). The widest version this CPU supports
+// is picked at runtime, the plain C one works everywhere.
+int count_state_scalar(const char *states, int length, char state)
+{
+    int count = 0;
+    for (int i = 0; i < length; i++)
+    {
+        count += states[i] == state;
+    }
+    return count;
+}
+
+int find_state_scalar(const char *states, int length, char state)
+{
+    int i = 0;
+    while (i < length && states[i] != state)
+    {
+        i++;
+    }
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 16 states per step: compare bytes, turn the result into a bit mask, count bits
+__attribute__((target("sse2"))) int count_state_sse2(const char *states, int length, char state)
+{
+    __m128i wanted = _mm_set1_epi8(state);
+    int count = 0;
+    int i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(states + i));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, wanted)));
+    }
+    return count + count_state_scalar(states + i, length - i, state);
+}
+
+__attribute__((target("sse2"))) int find_state_sse2(const char *states, int length, char state)
+{
+    __m128i wanted = _mm_set1_epi8(state);
+    int i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(states + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, wanted));
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + find_state_scalar(states + i, length - i, state);
+}
+
+// 32 states per step, same idea
+__attribute__((target("avx2,popcnt"))) int count_state_avx2(const char *states, int length, char state)
+{
+    __m256i wanted = _mm256_set1_epi8(state);
+    int count = 0;
+    int i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(states + i));
+        count += __builtin_popcount((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, wanted)));
+    }
+    return count + count_state_scalar(states + i, length - i, state);
+}
+
+__attribute__((target("avx2"))) int find_state_avx2(const char *states, int length, char state)
+{
+    __m256i wanted = _mm256_set1_epi8(state);
+    int i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(states + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, wanted));
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + find_state_scalar(states + i, length - i, state);
+}
+#endif
+
+int (*count_state_kernel)(const char *states, int length, char state) = NULL;
+int (*find_state_kernel)(const char *states, int length, char state) = NULL;
+const char *state_kernel_name = "";
+
+// Pick the state kernels for this CPU (CPUID through the compiler's builtins)
+void pick_state_kernels(void)
+{
+    count_state_kernel = count_state_scalar;
+    find_state_kernel = find_state_scalar;
+    state_kernel_name = "scalar";
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+    {
+        count_state_kernel = count_state_avx2;
+        find_state_kernel = find_state_avx2;
+        state_kernel_name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        count_state_kernel = count_state_sse2;
+        find_state_kernel = find_state_sse2;
+        state_kernel_name = "sse2";
+    }
+#endif
+}
+
+// Count the processes in a given state in a range of tour slots
+int count_state_in_range(int first, int last, char state)
+{
+    if (count_state_kernel == NULL)
+    {
+        pick_state_kernels();
+    }
+    return last < first ? 0 : count_state_kernel(columns.state + first, last - first + 1, state);
+}
+
+// First tour slot from first to last whose process is in a given state, -1 if none
+int next_state_in_range(int first, int last, char state)
+{
+    if (find_state_kernel == NULL)
+    {
+        pick_state_kernels();
+    }
+    if (last < first)
+    {
+        return -1;
+    }
+    int offset = find_state_kernel(columns.state + first, last - first + 1, state);
+    return first + offset <= last ? first + offset : -1;
+}
+
+// Batch mode: tree membership answers for one root, shared by every query
+// against it. member[pid] is 0 if not known yet, 1 if pid is in the tree and
+// 2 if it is not, so a walk up from a new PID stops at the first known ancestor.
+struct tree_cache
+{
+    int root;
+    unsigned long generation; // tree_generation the answers belong to
+    char *member;
+    int size;
+    int root_verdict;         // Cached is_root_process(root), -1 if not asked yet
+};
+
+#define TREE_CACHE_ROOTS 8
+struct tree_cache tree_caches[TREE_CACHE_ROOTS];
+int tree_cache_next = 0;    // Slot to reuse when every slot holds another root
+
+// Find the cache for a root, starting a fresh one if the tree has changed
+struct tree_cache *get_tree_cache(int root_process)
+{
+    struct tree_cache *cache = NULL;
+    for (int i = 0; i < TREE_CACHE_ROOTS; i++)
+    {
+        if (tree_caches[i].member != NULL && tree_caches[i].root == root_process)
+        {
+            cache = &tree_caches[i];
+        }
+    }
+    if (cache == NULL)
+    {
+        cache = &tree_caches[tree_cache_next];
+        tree_cache_next = (tree_cache_next + 1) % TREE_CACHE_ROOTS;
+        cache->root = root_process;
+        cache->generation = tree_generation - 1; // Forces the reset below
+    }
+
+    if (cache->generation != tree_generation || cache->size != snapshot.max_pid + 1)
+    {
+        if (cache->size != snapshot.max_pid + 1)
+        {
+            free(cache->member);
+            cache->size = snapshot.max_pid + 1;
+            cache->member = malloc(cache->size);
+            if (cache->member == NULL)
+            {
+                cache->size = 0;
+                return NULL;
+            }
+        }
+        memset(cache->member, 0, cache->size);
+        cache->root_verdict = -1;
+        cache->generation = tree_generation;
+    }
+    return cache;
+}
+
+int is_process_in_tree(int root_process, int process_id)
+{
+    // First check if both processes exist
+    if (!does_process_exist(root_process) || !does_process_exist(process_id))
+    {
+        write_text("One or both processes don't exist\n");
+        return 0;
+    }
+
+    // Init is never a tree root here, the walk below stops before reaching it
+    if (root_process <= 1)
+    {
+        return 0;
+    }
+
+    // With the snapshot numbered, membership is two compares
+    struct proc_entry *root = find_process(root_process);
+    struct proc_entry *process = find_process(process_id);
+    if (root != NULL && process != NULL && tour_ready() && root->enter != -1 && process->enter != -1)
+    {
+        return root->enter <= process->enter && process->leave <= root->leave;
+    }
+
+    // Processes the tour did not reach (their parent had not listed them yet when
+    // /proc was scanned) fall back to walking the parent chain.
+    // In batch mode, earlier queries may already know the answer for an ancestor
+    struct tree_cache *cache = batch_mode && find_process(process_id) != NULL ? get_tree_cache(root_process) : NULL;
+    int answer = 0;
+
+    // Start with the process we want to check
+    int current_pid = process_id;
+
+    // Keep going up the tree until we either find root_process or reach init
+    while (current_pid > 1)
+    { // 1 is the init process
+        // If we found the root_process, we're done!
+        if (current_pid == root_process)
+        {
+            answer = 1;
+            break;
+        }
+        if (cache != NULL && current_pid < cache->size && cache->member[current_pid] != 0)
+        {
+            answer = cache->member[current_pid] == 1;
+            break;
+        }
+
+        // Get the parent of current process
+        int parent_pid = get_parent_pid(current_pid);
+
+        // If we couldn't get parent PID, something went wrong
+        if (parent_pid == -1)
+        {
+            write_text("Couldn't get parent for process %d\n", current_pid);
+            return 0;
+        }
+
+        // Move up to the parent
+        current_pid = parent_pid;
+    }
+
+    // Remember the answer for every process on the path we just walked
+    if (cache != NULL)
+    {
+        for (int pid = process_id; pid != current_pid && pid > 1 && pid < cache->size; pid = get_parent_pid(pid))
+        {
+            cache->member[pid] = answer ? 1 : 2;
+        }
+    }
+
+    // If we got here without an answer, we reached init without finding root_process
+    return answer;
+}
+
+// Helper function to verify if a process is root of its tree
+int is_root_process(int pid)
+{
+    struct proc_entry *entry = find_process(pid);
+    if (entry == NULL)
+    {
+        return 0;
+    }
+
+    // Get parent PID
+    int ppid = entry->ppid;
+
+    // Batch mode asks about the same root over and over
+    struct tree_cache *cache = batch_mode ? get_tree_cache(pid) : NULL;
+    if (cache != NULL && cache->root_verdict != -1)
+    {
+        return cache->root_verdict;
+    }
+
+    // Check if parent is a bash process, only the program name is looked at.
+    // The live index has the name already, exec events keep it current
+    char cmd[256];
+    int verdict = 0;
+    struct proc_entry *parent = live_index ? find_process(ppid) : NULL;
+    if (parent != NULL)
+    {
+        verdict = (strstr(parent->comm, "bash") != NULL);
+    }
+    else if (!live_index && read_cmdline(ppid, cmd, sizeof(cmd)) != -1)
+    {
+        // Check if parent is bash
+        verdict = (strstr(cmd, "bash") != NULL);
+    }
+
+    if (cache != NULL)
+    {
+        cache->root_verdict = verdict;
+    }
+    return verdict;
+}
+
+// function to print immediate descendants of a process
+void list_immediate_descendants(int process_id)
+{
+    // Find the process in the snapshot
+    struct proc_entry *entry = find_process(process_id);
+
+    // Check if we know this process
+    if (entry == NULL)
+    {
+        write_text("Could not open children file for process %d\n", process_id);
+        return;
+    }
+
+    int found_children = 0; // Flag to track if we found any children
+
+    // Walk the children one by one
+    for (struct proc_entry *child = first_child_of(entry); child != NULL; child = next_sibling_of(child))
+    {
+        // If this is first child found, print header
+        if (!found_children)
+        {
+            write_text("Immediate descendants of %d:\n", process_id);
+            found_children = 1;
+        }
+        write_pid(child->pid);
+    }
+
+    // If no children were found
+    if (!found_children)
+    {
+        write_text("No immediate descendants found for process %d\n", process_id);
+    }
+}
+
+void list_non_direct_descendants(int process_id)
+{
+    // First get immediate childrem
+    struct proc_entry *entry = find_process(process_id);
+    if (entry == NULL)
+    {
+        write_text("No non-direct descendants found\n");
+        return;
+    }
+
+    int found_non_direct = 0; // Flag for non direct descendants
+
+    // For each immediate child, find their children (which are non-direct for original process)
+    for (struct proc_entry *child = first_child_of(entry); child != NULL; child = next_sibling_of(child))
+    {
+        // Now check children for this immediate child
+        for (struct proc_entry *grandchild = first_child_of(child); grandchild != NULL; grandchild = next_sibling_of(grandchild))
+        {
+            if (!found_non_direct)
+            {
+                write_text("Non-direct descendants of %d: \n", process_id);
+                found_non_direct = 1;
+            }
+            write_pid(grandchild->pid);
+        }
+    }
+    if (!found_non_direct)
+    {
+        write_text("No non-direct descendants found.\n");
+    }
+}
+
+void list_siblings(int process_id)
+{
+    // First get the parent ID of our process
+    int parent_pid = get_parent_pid(process_id);
+
+    // If we couldn't get parent, return
+    if (parent_pid == -1)
+    {
+        write_text("Could not find parent of process %d\n", process_id);
+        return;
+    }
+
+    // Now look for all children of this parent (these are siblings)
+    struct proc_entry *parent = find_process(parent_pid);
+    if (parent == NULL)
+    {
+        write_text("No siblings found\n");
+        return;
+    }
+
+    // Read all siblings
+    int found_siblings = 0;
+
+    for (struct proc_entry *sibling = first_child_of(parent); sibling != NULL; sibling = next_sibling_of(sibling))
+    {
+        // Don't list the process itself as its sibling
+        if (sibling->pid != process_id)
+        {
+            // Print header only when first sibling is found
+            if (!found_siblings)
+            {
+                write_text("Siblings of process %d:\n", process_id);
+                found_siblings = 1;
+            }
+            write_pid(sibling->pid);
+        }
+    }
+
+    // If no siblings were found (except itself)
+    if (!found_siblings)
+    {
+        write_text("No siblings found for process %d\n", process_id);
+    }
+}
+
+void list_grandchildren(int process_id)
+{
+    // First get immediate children
+    struct proc_entry *entry = find_process(process_id);
+    if (entry == NULL)
+    {
+        write_text("No grandchildren found (no children)\n");
+        return;
+    }
+
+    int found_grandchildren = 0; // Flag to track if we found any grandchildren
+
+    // For each child, find their children (our grandchildren)
+    for (struct proc_entry *child = first_child_of(entry); child != NULL; child = next_sibling_of(child))
+    {
+        // Read each grandchild
+        for (struct proc_entry *grandchild = first_child_of(child); grandchild != NULL; grandchild = next_sibling_of(grandchild))
+        {
+            // Print header only for first grandchild
+            if (!found_grandchildren)
+            {
+                write_text("Grandchildren of process %d:\n", process_id);
+                found_grandchildren = 1;
+            }
+            write_pid(grandchild->pid);
+        }
+    }
+
+    // If no grandchildren were found
+    if (!found_grandchildren)
+    {
+        write_text("No grandchildren found for process %d\n", process_id);
+    }
+}
+
+void check_if_defunct(int process_id)
+{
+    // Find the process in the snapshot
+    struct proc_entry *entry = find_process(process_id);
+    if (entry == NULL)
+    {
+        write_text("Cannot open status file for process %d\n", process_id);
+        return;
+    }
+
+    // Print result, 'Z' is the zombie/defunct state
+    if (entry->state == 'Z')
+    {
+        write_text("Defunct\n");
+    }
+    else
+    {
+        write_text("Not defunct\n");
+    }
+}
+
+void list_defunct_siblings(int process_id)
+{
+    // First get the parent ID of our process
+    int parent_pid = get_parent_pid(process_id);
+
+    // If we couldn't get parent, return
+    if (parent_pid == -1)
+    {
+        write_text("Could not find parent of process %d\n", process_id);
+        return;
+    }
+
+    // Now look for all children of this parent (these are siblings)
+    struct proc_entry *parent = find_process(parent_pid);
+    if (parent == NULL)
+    {
+        write_text("No defunct siblings found\n");
+        return;
+    }
+
+    // Read all siblings
+    int found_defunct_siblings = 0;
+
+    for (struct proc_entry *sibling = first_child_of(parent); sibling != NULL; sibling = next_sibling_of(sibling))
+    {
+        // Don't check the process itself, and skip siblings that are not zombies
+        if (sibling->pid != process_id && sibling->state == 'Z')
+        {
+            // Print header only for first defunct sibling
+            if (!found_defunct_siblings)
+            {
+                write_text("Defunct siblings of process %d:\n", process_id);
+                found_defunct_siblings = 1;
+            }
+            write_pid(sibling->pid);
+        }
+    }
+
+    // If no defunct siblings were found
+    if (!found_defunct_siblings)
+    {
+        write_text("No defunct siblings found for process %d\n", process_id);
+    }
+}
+
+// Helper function to check if a process is defunct
+int is_defunct(int pid)
+{
+    struct proc_entry *entry = find_process(pid);
+    return entry != NULL && entry->state == 'Z';
+}
+
+// Data shared by check_descendants and its visitor
+struct defunct_check
+{
+    int count;      // Number of defunct descendants found so far
+    int print_pids; // 1 to print each one (-df), 0 to only count (-dc)
+};
+
+// Visitor: count (and maybe print) one defunct descendant
+int check_defunct_visitor(struct walk_step *step, void *context)
+{
+    struct defunct_check *check = context;
+
+    // Check if this child is defunct
+    if (step->entry->state == 'Z')
+    {
+        check->count++; // Increment counter
+        if (check->print_pids)
+        { // Only print if -df option
+            if (check->count == 1)
+            { // Print header only once
+                write_text("Defunct descendants:\n");
+            }
+            write_pid(step->entry->pid);
+        }
+    }
+    return 0;
+}
+
+// Check all descendants for defunct processes, returns how many there are
+int check_descendants(int pid, int print_pids)
+{
+    // With the tour numbered, the descendants are one contiguous range of slots
+    struct proc_entry *root = find_process(pid);
+    if (root != NULL && tour_ready() && root->enter != -1)
+    {
+        if (!print_pids)
+        {
+            return count_state_in_range(root->enter + 1, root->leave, 'Z');
+        }
+
+        // Same order as the depth first walk, since the tour came from one
+        int count = 0;
+        for (int slot = next_state_in_range(root->enter + 1, root->leave, 'Z'); slot != -1;
+             slot = next_state_in_range(slot + 1, root->leave, 'Z'))
+        {
+            if (count++ == 0)
+            {
+                write_text("Defunct descendants:\n");
+            }
+            write_pid(columns.pid[slot]);
+        }
+        return count;
+    }
+
+    struct defunct_check check = {0, print_pids};
+    walk_subtree(pid, WALK_PRE, check_defunct_visitor, &check);
+    return check.count;
+}
+
+// Function for -df option
+void list_defunct_descendants(int process_id)
+{
+    int count = check_descendants(process_id, 1); // 1 means print PIDs
+
+    if (count == 0)
+    {
+        write_text("No defunct descendants found for process %d\n", process_id);
+    }
+}
+
+// Function for -dc option
+void count_defunct_descendants(int process_id)
+{
+    int count = check_descendants(process_id, 0); // 0 means don't print PIDs
+    write_count(count);                           // Print the count
+}
+
+void check_if_orphan(int process_id)
+{
+    // Get original parent PID
+    int original_ppid = get_parent_pid(process_id);
+
+    // If parent is init (PID 1), process is orphan
+    if (original_ppid == 1)
+    {
+        write_text("Orphan\n");
+        return;
+    }
+
+    // Look the parent up in the snapshot
+    if (find_process(original_ppid) == NULL)
+    {
+        // Parent is not in the snapshot - parent doesn't exist
+        write_text("Orphan\n");
+        return;
+    }
+
+    write_text("Not Orphan\n");
+}
+
+// Helper function to check if a process is orphan
+int is_orphan(int pid)
+{
+    struct proc_entry *entry = find_process(pid);
+    if (entry == NULL)
+    {
+        return 0; // Process doesn't exist
+    }
+
+    // A process is orphaned if its parent PID is 1 (adopted by init)
+    return (entry->ppid == 1);
+}
+
+// Visitor for list_orphan_descendants
+int orphan_visitor(struct walk_step *step, void *context)
+{
+    (void)context;
+
+    // All descendants of this child are done, check if the child is an orphan
+    if (is_orphan(step->entry->pid))
+    {
+        write_labeled_pid("Orphaned descendant", step->entry->pid);
+    }
+    return 0;
+}
+
+// Function to list all orphan descendants
+void list_orphan_descendants(int process_id)
+{
+    if (!walk_subtree(process_id, WALK_POST, orphan_visitor, NULL))
+    {
+        write_text("Could not find process %d\n", process_id);
+    }
+}
+
+// Helper function to check if a process is zombie
+int is_zombie(int pid)
+{
+    struct proc_entry *entry = find_process(pid);
+    return entry != NULL && entry->state == 'Z'; // Zombie state
+}
+
+// Helper function to get parent PID
+int get_parent_pid_new(int pid)
+{
+    struct proc_entry *entry = find_process(pid);
+    if (entry == NULL)
+    {
+        return -1;
+    }
+    return entry->ppid;
+}
+
+// A list of PIDs that remembers which PIDs it holds, so "is it in the list"
+// is a single array lookup
+struct pid_set
+{
+    int *pids;           // PIDs in the order they were added
+    int count;
+    int capacity;
+    unsigned char *mark; // mark[pid] = 1 if pid is in the list
+    int mark_size;
+};
+
+// Check if a PID is in the set
+int pid_set_contains(struct pid_set *set, int pid)
+{
+    return pid > 0 && pid < set->mark_size && set->mark[pid];
+}
+
+// Add a PID to the set, returns 0 if it was already there or memory ran out
+int pid_set_add(struct pid_set *set, int pid)
+{
+    if (pid <= 0 || pid_set_contains(set, pid))
+    {
+        return 0;
+    }
+
+    // Make the mark array big enough for this PID
+    if (pid >= set->mark_size)
+    {
+        int new_size = set->mark_size ? set->mark_size : 1024;
+        while (new_size <= pid)
+        {
+            new_size *= 2;
+        }
+        unsigned char *grown = realloc(set->mark, new_size);
+        if (grown == NULL)
+        {
+            return 0;
+        }
+        memset(grown + set->mark_size, 0, new_size - set->mark_size);
+        set->mark = grown;
+        set->mark_size = new_size;
+    }
+
+    if (set->count == set->capacity)
+    {
+        int new_capacity = set->capacity ? set->capacity * 2 : 64;
+        int *grown = realloc(set->pids, new_capacity * sizeof(int));
+        if (grown == NULL)
+        {
+            return 0;
+        }
+        set->pids = grown;
+        set->capacity = new_capacity;
+    }
+
+    set->pids[set->count++] = pid;
+    set->mark[pid] = 1;
+    return 1;
+}
+
+// Free the memory held by a set
+void pid_set_free(struct pid_set *set)
+{
+    free(set->pids);
+    free(set->mark);
+    memset(set, 0, sizeof(*set));
+}
+
+// Read the current state letter of a process straight from /proc,
+// returns 0 if the process is gone
+char get_live_state(int pid)
+{
+    char stat[512];
+    if (read_proc_file(pid, 0, "stat", stat, sizeof(stat)) == -1)
+    {
+        return 0;
+    }
+
+    const char *close_paren = strrchr(stat, ')');
+    if (close_paren == NULL || close_paren[1] == '\0')
+    {
+        return 0;
+    }
+    return close_paren[2]; // The state follows ") "
+}
+
+// How long to wait for signalled processes to react, in milliseconds
+int signal_timeout_ms = 2000;
+
+// What wait_for_pids waits for
+#define WAIT_EXITED 0    // Process is gone or has become a zombie
+#define WAIT_GONE 1      // Process is gone completely (zombie has been reaped)
+#define WAIT_STOPPED 2   // Process is stopped (T state) or gone
+#define WAIT_CONTINUED 3 // Process is no longer stopped
+
+// Check one process against what we are waiting for
+int has_reached(int pid, int wanted)
+{
+    char state = get_live_state(pid);
+    switch (wanted)
+    {
+    case WAIT_EXITED:
+        return state == 0 || state == 'Z' || state == 'X';
+    case WAIT_GONE:
+        return state == 0;
+    case WAIT_STOPPED:
+        return state == 0 || state == 'T' || state == 'Z' || state == 'X';
+    default:
+        return state != 'T';
+    }
+}
+
+// Poll all PIDs of the set together until every one has reached the wanted
+// state or the deadline passes. done[i] is set for each PID that made it.
+// If fds is given, processes with a handle are waited for with poll(), which
+// wakes up as soon as they exit; the rest are checked through /proc.
+// Returns how many PIDs did not make it in time.
+int wait_for_pids(struct pid_set *set, int *fds, int wanted, char *done)
+{
+    double deadline = now_ms() + signal_timeout_ms;
+    int remaining = set->count;
+    int pause_ms = 1; // Start with short pauses and back off
+
+    // poll() only tells us about exits, not about stops
+    struct pollfd *polls = NULL;
+    int *poll_owner = NULL;
+    if (fds != NULL && wanted == WAIT_EXITED && set->count > 0)
+    {
+        polls = malloc(set->count * sizeof(struct pollfd));
+        poll_owner = malloc(set->count * sizeof(int));
+        if (polls == NULL || poll_owner == NULL)
+        {
+            free(polls);
+            free(poll_owner);
+            polls = NULL;
+            fds = NULL;
+        }
+    }
+
+    memset(done, 0, set->count);
+    while (remaining > 0)
+    {
+        int poll_count = 0;
+        int only_handles = 1; // 1 if every pending process has a handle
+
+        for (int i = 0; i < set->count; i++)
+        {
+            if (done[i])
+            {
+                continue;
+            }
+            if (polls != NULL && fds[i] >= 0)
+            {
+                polls[poll_count].fd = fds[i];
+                polls[poll_count].events = POLLIN;
+                polls[poll_count].revents = 0;
+                poll_owner[poll_count++] = i;
+            }
+            else if (has_reached(set->pids[i], wanted))
+            {
+                done[i] = 1;
+                remaining--;
+            }
+            else
+            {
+                only_handles = 0;
+            }
+        }
+
+        double left_ms = deadline - now_ms();
+        if (remaining == 0 || left_ms <= 0)
+        {
+            break;
+        }
+
+        // With only handles left we can sleep in poll() until the deadline
+        int wait_ms = only_handles ? (int)left_ms + 1 : pause_ms;
+        if (poll_count > 0)
+        {
+            if (poll(polls, poll_count, wait_ms) > 0)
+            {
+                for (int p = 0; p < poll_count; p++)
+                {
+                    if (polls[p].revents != 0)
+                    {
+                        done[poll_owner[p]] = 1;
+                        remaining--;
+                    }
+                }
+            }
+        }
+        else
+        {
+            usleep(wait_ms * 1000);
+        }
+
+        if (pause_ms < 20)
+        {
+            pause_ms *= 2;
+        }
+    }
+
+    free(polls);
+    free(poll_owner);
+    return remaining;
+}
+
+// Use pidfd handles for -sk and -rp, so a recycled PID is never signalled
+int use_pidfd = 0;
+
+// Process handles kept next to a pid_set: fds[i] belongs to the i-th PID of the
+// set, -1 if there is no handle for it (zombie, or pidfd not available)
+struct pidfd_table
+{
+    int *fds;
+    int count;
+    int capacity;
+};
+
+// Append one handle (or -1) to the table
+void pidfd_table_push(struct pidfd_table *table, int fd)
+{
+    if (table->count == table->capacity)
+    {
+        int new_capacity = table->capacity ? table->capacity * 2 : 64;
+        int *grown = realloc(table->fds, new_capacity * sizeof(int));
+        if (grown == NULL)
+        {
+            if (fd >= 0)
+            {
+                close(fd); // No room, the process will be handled by PID instead
+            }
+            return;
+        }
+        table->fds = grown;
+        table->capacity = new_capacity;
+    }
+    table->fds[table->count++] = fd;
+}
+
+// Close every handle and free the table
+void pidfd_table_free(struct pidfd_table *table)
+{
+    for (int i = 0; i < table->count; i++)
+    {
+        if (table->fds[i] >= 0)
+        {
+            close(table->fds[i]);
+        }
+    }
+    free(table->fds);
+    memset(table, 0, sizeof(*table));
+}
+
+// Let this process hold as many handles as the hard limit allows
+void raise_fd_limit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// Open a pidfd for a process from the snapshot.
+// The PID may have been recycled since the snapshot was taken, so after opening
+// the handle we check that the process behind the PID still has the start time
+// we saw in the snapshot. If it does, the handle is for that very process.
+// Returns the fd, -2 if the process is gone or is a different process now,
+// and -1 if pidfds can't be used (old kernel, seccomp, out of fds).
+int open_checked_pidfd(struct proc_entry *entry)
+{
+    int fd = syscall(SYS_pidfd_open, entry->pid, 0);
+    if (fd == -1)
+    {
+        return errno == ESRCH ? -2 : -1;
+    }
+
+    struct proc_entry now;
+    if (!read_stat_entry(entry->pid, &now) || now.start_time != entry->start_time)
+    {
+        close(fd);
+        return -2;
+    }
+    return fd;
+}
+
+// Send a signal through a handle when we have one, by PID otherwise
+int send_signal(int fd, int pid, int sig)
+{
+    if (fd >= 0)
+    {
+        return syscall(SYS_pidfd_send_signal, fd, sig, NULL, 0);
+    }
+    return kill(pid, sig);
+}
+
+// Data shared by freeze_subtree and its visitor
+struct freeze_sweep
+{
+    struct pid_set *seen;    // Every descendant found, in post-order
+    struct pid_set *zombies; // Descendants that are zombies and can't be stopped
+    struct pidfd_table *handles; // Handles parallel to seen, NULL when not using pidfds
+    int new_found;           // Processes stopped during this pass
+    int report;              // 1 to print each process as it is stopped (-st)
+};
+
+// Visitor: send SIGSTOP to one descendant we haven't stopped yet
+int freeze_visitor(struct walk_step *step, void *context)
+{
+    struct freeze_sweep *sweep = context;
+    struct proc_entry *child = step->entry;
+
+    if (pid_set_contains(sweep->seen, child->pid))
+    {
+        return 0; // Already handled in an earlier pass
+    }
+
+    // Skip zombie processes
+    if (child->state == 'Z')
+    {
+        if (pid_set_add(sweep->seen, child->pid) && sweep->handles != NULL)
+        {
+            pidfd_table_push(sweep->handles, -1);
+        }
+        pid_set_add(sweep->zombies, child->pid);
+        if (sweep->report)
+        {
+            write_text("Process %d is a zombie and cannot be stopped\n", child->pid);
+        }
+        return 0;
+    }
+
+    int fd = -1;
+    if (sweep->handles != NULL)
+    {
+        fd = open_checked_pidfd(child);
+        if (fd == -2)
+        {
+            return 0; // Exited, or the PID now belongs to someone else
+        }
+    }
+
+    if (send_signal(fd, child->pid, SIGSTOP) == -1)
+    {
+        if (errno != ESRCH) // A process that just exited is not an error
+        {
+            perror("Failed to stop process");
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return 0;
+    }
+
+    if (!pid_set_add(sweep->seen, child->pid))
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return 0;
+    }
+    if (sweep->handles != NULL)
+    {
+        pidfd_table_push(sweep->handles, fd);
+    }
+    sweep->new_found++;
+    if (sweep->report)
+    {
+        write_labeled_pid("Stopped process", child->pid);
+    }
+    return 0;
+}
+
+// Stop every descendant in one sweep, then rescan and repeat until a pass finds
+// nothing new, so children forked while we were sweeping are caught as well.
+// With handles given, each process is signalled through a checked pidfd.
+void freeze_subtree(int process_id, struct pid_set *seen, struct pid_set *zombies, struct pidfd_table *handles, int report)
+{
+    struct freeze_sweep sweep = {seen, zombies, handles, 0, report};
+
+    for (int pass = 0; pass < 8; pass++)
+    {
+        // Every pass after the first needs a fresh look at /proc
+        if (pass > 0)
+        {
+            snapshot_build();
+        }
+
+        sweep.new_found = 0;
+        if (!walk_subtree(process_id, WALK_POST, freeze_visitor, &sweep) || sweep.new_found == 0)
+        {
+            break;
+        }
+    }
+}
+
+// Collects the descendants that are in a given state
+struct state_collect
+{
+    char state;
+    struct pid_set *found;
+};
+
+// Visitor: remember descendants that are in the wanted state
+int state_collect_visitor(struct walk_step *step, void *context)
+{
+    struct state_collect *collect = context;
+    if (step->entry->state == collect->state)
+    {
+        pid_set_add(collect->found, step->entry->pid);
+    }
+    return 0;
+}
+
+// Order tour slots the way a post-order walk would visit them: a subtree that
+// closes earlier comes first, and a process comes after its descendants
+int compare_post_order(const void *a, const void *b)
+{
+    int slot_a = *(const int *)a;
+    int slot_b = *(const int *)b;
+    if (columns.leave[slot_a] != columns.leave[slot_b])
+    {
+        return columns.leave[slot_a] < columns.leave[slot_b] ? -1 : 1;
+    }
+    return slot_b - slot_a;
+}
+
+// Collect the descendants of a process that are in a given state, in post-order.
+// Returns 0 if the tour is not available and the caller should walk instead.
+int collect_state_in_subtree(int pid, char state, struct pid_set *found)
+{
+    struct proc_entry *root = find_process(pid);
+    if (root == NULL || !tour_ready() || root->enter == -1)
+    {
+        return 0;
+    }
+
+    int count = count_state_in_range(root->enter + 1, root->leave, state);
+    int *slots = malloc((count + 1) * sizeof(int));
+    if (slots == NULL)
+    {
+        return 0;
+    }
+    int found_count = 0;
+    for (int slot = next_state_in_range(root->enter + 1, root->leave, state);
+         slot != -1 && found_count < count;
+         slot = next_state_in_range(slot + 1, root->leave, state))
+    {
+        slots[found_count++] = slot;
+    }
+
+    qsort(slots, found_count, sizeof(int), compare_post_order);
+    for (int i = 0; i < found_count; i++)
+    {
+        pid_set_add(found, columns.pid[slots[i]]);
+    }
+    free(slots);
+    return 1;
+}
+
+// Function to kill parents of all zombie descendants, deepest first.
+// All parents are killed first, then one batched poll checks the zombies.
+void kill_parents_of_zombies(int process_id)
+{
+    struct pid_set zombies = {0};
+    struct pid_set killed_parents = {0};
+    struct state_collect collect = {'Z', &zombies};
+    walk_subtree(process_id, WALK_POST, state_collect_visitor, &collect);
+
+    for (int i = 0; i < zombies.count; i++)
+    {
+        // Get the parent PID of the zombie process
+        int zombie_pid = zombies.pids[i];
+        int parent_pid = find_process(zombie_pid)->ppid;
+
+        // Init reaps its own zombies, there is no parent to kill
+        if (parent_pid <= 1)
+        {
+            write_text("Zombie process %d has no parent to kill, init reaps it\n", zombie_pid);
+            continue;
+        }
+
+        // Kill the parent of the zombie, once even if it has several zombies
+        if (pid_set_contains(&killed_parents, parent_pid))
+        {
+            write_text("Parent %d of zombie process %d was already killed\n", parent_pid, zombie_pid);
+        }
+        else if (kill(parent_pid, SIGKILL) == -1)
+        {
+            perror("Failed to kill parent");
+        }
+        else
+        {
+            pid_set_add(&killed_parents, parent_pid);
+            write_text("Killed parent %d of zombie process %d\n", parent_pid, zombie_pid);
+        }
+    }
+
+    // Wait for init to clean up all the zombies at once
+    char *cleaned = malloc(zombies.count + 1);
+    if (cleaned != NULL)
+    {
+        wait_for_pids(&zombies, NULL, WAIT_GONE, cleaned);
+        for (int i = 0; i < zombies.count; i++)
+        {
+            // Verify if the zombie is removed
+            if (cleaned[i])
+            {
+                write_text("Zombie process %d has been cleaned up\n", zombies.pids[i]);
+            }
+            else
+            {
+                write_text("Zombie process %d still exists\n", zombies.pids[i]);
+            }
+        }
+        free(cleaned);
+    }
+
+    pid_set_free(&killed_parents);
+    pid_set_free(&zombies);
+}
+
+// Find where the cgroup v2 hierarchy is mounted, returns 0 if it isn't
+int find_cgroup2_mount(char *mount_dir, int size)
+{
+    FILE *mountinfo = fopen("/proc/self/mountinfo", "r");
+    if (mountinfo == NULL)
+    {
+        return 0;
+    }
+
+    // Lines look like "42 32 0:38 / /sys/fs/cgroup rw,relatime - cgroup2 cgroup2 rw"
+    char line[1024];
+    int found = 0;
+    while (!found && fgets(line, sizeof(line), mountinfo))
+    {
+        char mount_point[512];
+        char *separator = strstr(line, " - cgroup2 ");
+        if (separator != NULL && sscanf(line, "%*s %*s %*s %*s %511s", mount_point) == 1)
+        {
+            snprintf(mount_dir, size, "%s", mount_point);
+            found = 1;
+        }
+    }
+    fclose(mountinfo);
+    return found;
+}
+
+// Read the cgroup v2 path of a process (the "0::" line), returns 0 if it has none
+int read_cgroup_path(int pid, char *path, int size)
+{
+    char text[4096];
+    if (read_proc_file(pid, 0, "cgroup", text, sizeof(text)) == -1)
+    {
+        return 0;
+    }
+
+    // The v2 line is "0::/some/path", there is only one
+    char *line = text;
+    while (line != NULL && *line != '\0')
+    {
+        if (strncmp(line, "0::", 3) == 0)
+        {
+            char *end = strchr(line, '\n');
+            int length = end ? end - (line + 3) : (int)strlen(line + 3);
+            if (length >= size)
+            {
+                return 0;
+            }
+            memcpy(path, line + 3, length);
+            path[length] = '\0';
+            return 1;
+        }
+        line = strchr(line, '\n');
+        if (line != NULL)
+        {
+            line++;
+        }
+    }
+    return 0;
+}
+
+// Data shared by find_subtree_cgroup and its visitor
+struct cgroup_check
+{
+    struct pid_set members;  // Live descendants, the PIDs the cgroup must hold
+    char group[PATH_MAX];    // Deepest cgroup holding every descendant seen so far
+    int unreadable;          // 1 once the cgroup of a descendant could not be read
+};
+
+// Is path the group itself or one of its child groups?
+int cgroup_contains(const char *group, const char *path)
+{
+    if (strcmp(group, "/") == 0)
+    {
+        return 1;
+    }
+    int length = strlen(group);
+    return strncmp(path, group, length) == 0 && (path[length] == '\0' || path[length] == '/');
+}
+
+// Visitor: narrow the group down to the deepest one every live descendant is in
+int cgroup_check_visitor(struct walk_step *step, void *context)
+{
+    struct cgroup_check *check = context;
+
+    // Zombies have already left their cgroup
+    if (step->entry->state == 'Z')
+    {
+        return 0;
+    }
+
+    char path[PATH_MAX];
+    if (!read_cgroup_path(step->entry->pid, path, sizeof(path)))
+    {
+        check->unreadable = 1;
+        return 1;
+    }
+
+    if (check->members.count == 0)
+    {
+        strcpy(check->group, path);
+    }
+    else
+    {
+        // Cut the group back to the last '/' until this descendant is inside it,
+        // so the answer does not depend on which descendant the walk saw first
+        while (!cgroup_contains(check->group, path))
+        {
+            char *slash = strrchr(check->group, '/');
+            if (slash == check->group)
+            {
+                slash[1] = '\0'; // Down to the root cgroup
+            }
+            else
+            {
+                *slash = '\0';
+            }
+        }
+    }
+    pid_set_add(&check->members, step->entry->pid);
+    return 0;
+}
+
+// Read cgroup.procs of a group and of all groups below it and check that every
+// PID is one of the members. Returns the number of PIDs found, -1 on a stranger.
+int count_cgroup_procs(const char *group_dir, struct pid_set *members)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/cgroup.procs", group_dir);
+    FILE *procs = fopen(path, "r");
+    if (procs == NULL)
+    {
+        return -1;
+    }
+
+    int count = 0;
+    int pid;
+    while (fscanf(procs, "%d", &pid) == 1)
+    {
+        if (!pid_set_contains(members, pid))
+        {
+            fclose(procs);
+            return -1; // Someone outside the subtree shares the group
+        }
+        count++;
+    }
+    fclose(procs);
+
+    // Child groups are frozen and killed along with their parent, check them too
+    DIR *dir = opendir(group_dir);
+    if (dir == NULL)
+    {
+        return -1;
+    }
+    struct dirent *dir_entry;
+    while (count >= 0 && (dir_entry = readdir(dir)) != NULL)
+    {
+        if (dir_entry->d_type != DT_DIR || dir_entry->d_name[0] == '.')
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", group_dir, dir_entry->d_name);
+        int below = count_cgroup_procs(path, members);
+        count = below < 0 ? -1 : count + below;
+    }
+    closedir(dir);
+    return count;
+}
+
+// Find a cgroup v2 group whose membership is exactly the live descendants of
+// process_id. Fills group_dir and returns 1 if there is one; otherwise returns 0
+// and puts the reason in reason. The group is the deepest one that holds every
+// live descendant, never the group of process_id itself: cgroup.kill and
+// cgroup.freeze act on every process in the group, and the root must survive.
+int find_subtree_cgroup(int process_id, char *group_dir, int size, const char **reason)
+{
+    char mount_dir[512];
+    if (!find_cgroup2_mount(mount_dir, sizeof(mount_dir)))
+    {
+        *reason = "no cgroup v2 hierarchy";
+        return 0;
+    }
+
+    struct cgroup_check *check = calloc(1, sizeof(struct cgroup_check));
+    if (check == NULL)
+    {
+        *reason = "out of memory";
+        return 0;
+    }
+    walk_subtree(process_id, WALK_PRE | WALK_BFS, cgroup_check_visitor, check);
+
+    int found = 0;
+    char root_group[PATH_MAX];
+    if (check->unreadable)
+    {
+        *reason = "cannot read the cgroup of every descendant";
+    }
+    else if (check->members.count == 0)
+    {
+        *reason = "no live descendants";
+    }
+    else if (strcmp(check->group, "/") == 0)
+    {
+        *reason = "descendants share no cgroup below the root cgroup";
+    }
+    else if (!read_cgroup_path(process_id, root_group, sizeof(root_group)))
+    {
+        *reason = "cannot read the cgroup of the root process";
+    }
+    else if (cgroup_contains(check->group, root_group))
+    {
+        *reason = "the root process is in the descendants' cgroup";
+    }
+    else
+    {
+        snprintf(group_dir, size, "%s%s", mount_dir, check->group);
+        if (count_cgroup_procs(group_dir, &check->members) == check->members.count)
+        {
+            found = 1;
+        }
+        else
+        {
+            *reason = "cgroup also holds processes outside the subtree";
+        }
+    }
+
+    pid_set_free(&check->members);
+    free(check);
+    return found;
+}
+
+// Write a value into a cgroup control file like cgroup.freeze
+int write_cgroup_file(const char *group_dir, const char *name, const char *value)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", group_dir, name);
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return 0;
+    }
+    int ok = write(fd, value, strlen(value)) == (ssize_t)strlen(value);
+    close(fd);
+    return ok;
+}
+
+// Wait until cgroup.events shows "<key> <value>", returns 0 on timeout
+int wait_cgroup_event(const char *group_dir, const char *key, char value)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/cgroup.events", group_dir);
+    double deadline = now_ms() + signal_timeout_ms;
+
+    while (1)
+    {
+        char events[256];
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            return 0;
+        }
+        int length = read(fd, events, sizeof(events) - 1);
+        close(fd);
+
+        if (length > 0)
+        {
+            events[length] = '\0';
+            char *line = strstr(events, key);
+            int key_length = strlen(key);
+            if (line != NULL && line[key_length] == ' ' && line[key_length + 1] == value)
+            {
+                return 1;
+            }
+        }
+
+        if (now_ms() >= deadline)
+        {
+            return 0;
+        }
+        usleep(1000);
+    }
+}
+
+// Function to kill all descendants. The subtree is frozen first so nothing can
+// fork while we work, then everything gets SIGKILL and one poll confirms the exits.
+// With --pidfd every process is held by a pidfd from the freeze onwards.
+void kill_all_descendants(int process_id)
+{
+    // If the subtree is exactly one cgroup, cgroup.kill does it all at once
+    char group_dir[PATH_MAX];
+    const char *reason = "";
+    if (find_subtree_cgroup(process_id, group_dir, sizeof(group_dir), &reason))
+    {
+        if (write_cgroup_file(group_dir, "cgroup.kill", "1"))
+        {
+            write_text("Using cgroup v2 fast path: %s\n", group_dir);
+            if (!wait_cgroup_event(group_dir, "populated", '0'))
+            {
+                write_text("Processes in %s did not exit within %d ms\n", group_dir, signal_timeout_ms);
+            }
+            return;
+        }
+        reason = "cgroup.kill is not supported";
+    }
+    write_text("Using per-PID walk: %s\n", reason);
+
+    struct pid_set seen = {0};
+    struct pid_set zombies = {0};
+    struct pid_set killed = {0};
+    struct pidfd_table handles = {0};
+    struct pidfd_table killed_handles = {0};
+
+    if (use_pidfd)
+    {
+        raise_fd_limit();
+    }
+    freeze_subtree(process_id, &seen, &zombies, use_pidfd ? &handles : NULL, 0);
+
+    for (int i = 0; i < seen.count; i++)
+    {
+        int child_pid = seen.pids[i];
+        // If the handle table ever fell out of step with the PID list, use PIDs
+        int fd = use_pidfd && handles.count == seen.count ? handles.fds[i] : -1;
+
+        // Check if child is a zombie
+        if (pid_set_contains(&zombies, child_pid))
+        {
+            write_text("Zombie process detected: PID = %d (Cannot kill zombie directly using SIGKILL)\n", child_pid);
+        }
+        else if (send_signal(fd, child_pid, SIGKILL) == -1) // Kill non-zombie processes directly
+        {
+            write_text("Failed to kill process %d\n", child_pid);
+        }
+        else
+        {
+            pid_set_add(&killed, child_pid);
+            if (use_pidfd)
+            {
+                pidfd_table_push(&killed_handles, fd); // The handle moves to the killed list
+                if (fd >= 0)
+                {
+                    handles.fds[i] = -1;
+                }
+            }
+            write_labeled_pid("Killed process", child_pid);
+        }
+    }
+
+    // Confirm that every killed process is really gone
+    char *exited = malloc(killed.count + 1);
+    if (exited != NULL)
+    {
+        int *fds = use_pidfd && killed_handles.count == killed.count ? killed_handles.fds : NULL;
+        if (wait_for_pids(&killed, fds, WAIT_EXITED, exited) > 0)
+        {
+            for (int i = 0; i < killed.count; i++)
+            {
+                if (!exited[i])
+                {
+                    write_text("Process %d did not exit within %d ms\n", killed.pids[i], signal_timeout_ms);
+                }
+            }
+        }
+        free(exited);
+    }
+
+    pidfd_table_free(&killed_handles);
+    pidfd_table_free(&handles);
+    pid_set_free(&killed);
+    pid_set_free(&zombies);
+    pid_set_free(&seen);
+}
+
+// Function to send SIGSTOP to all descendants, catching children forked meanwhile
+void stop_all_descendants(int process_id)
+{
+    // If the subtree is exactly one cgroup, freeze the whole group at once
+    char group_dir[PATH_MAX];
+    const char *reason = "";
+    if (find_subtree_cgroup(process_id, group_dir, sizeof(group_dir), &reason))
+    {
+        if (write_cgroup_file(group_dir, "cgroup.freeze", "1"))
+        {
+            write_text("Using cgroup v2 fast path: %s\n", group_dir);
+            if (!wait_cgroup_event(group_dir, "frozen", '1'))
+            {
+                write_text("Processes in %s did not freeze within %d ms\n", group_dir, signal_timeout_ms);
+            }
+            return;
+        }
+        reason = "cgroup.freeze is not supported";
+    }
+    write_text("Using per-PID walk: %s\n", reason);
+
+    struct pid_set seen = {0};
+    struct pid_set zombies = {0};
+    freeze_subtree(process_id, &seen, &zombies, NULL, 1);
+
+    // Confirm that every process we signalled has really stopped
+    char *stopped = malloc(seen.count + 1);
+    if (stopped != NULL)
+    {
+        if (wait_for_pids(&seen, NULL, WAIT_STOPPED, stopped) > 0)
+        {
+            for (int i = 0; i < seen.count; i++)
+            {
+                if (!stopped[i])
+                {
+                    write_text("Process %d did not stop within %d ms\n", seen.pids[i], signal_timeout_ms);
+                }
+            }
+        }
+        free(stopped);
+    }
+
+    pid_set_free(&zombies);
+    pid_set_free(&seen);
+}
+
+// Function to send SIGCONT to all paused descendants
+void continue_all_paused_descendants(int process_id)
+{
+    // Thaw the subtree's cgroup if -st froze it that way
+    char group_dir[PATH_MAX];
+    const char *reason = "";
+    if (find_subtree_cgroup(process_id, group_dir, sizeof(group_dir), &reason))
+    {
+        char frozen[8];
+        char freeze_path[PATH_MAX + 16];
+        snprintf(freeze_path, sizeof(freeze_path), "%s/cgroup.freeze", group_dir);
+        int fd = open(freeze_path, O_RDONLY | O_CLOEXEC);
+        int length = fd == -1 ? -1 : read(fd, frozen, sizeof(frozen));
+        if (fd != -1)
+        {
+            close(fd);
+        }
+
+        if (length > 0 && frozen[0] == '1' && write_cgroup_file(group_dir, "cgroup.freeze", "0"))
+        {
+            write_text("Using cgroup v2 fast path: %s\n", group_dir);
+            if (!wait_cgroup_event(group_dir, "frozen", '0'))
+            {
+                write_text("Processes in %s did not thaw within %d ms\n", group_dir, signal_timeout_ms);
+            }
+        }
+        else
+        {
+            write_text("Using per-PID walk: cgroup %s is not frozen\n", group_dir);
+        }
+    }
+    else
+    {
+        write_text("Using per-PID walk: %s\n", reason);
+    }
+
+    // Processes stopped by SIGSTOP still need SIGCONT, frozen or not
+    struct pid_set paused = {0};
+    struct pid_set resumed = {0};
+    if (!collect_state_in_subtree(process_id, 'T', &paused))
+    {
+        struct state_collect collect = {'T', &paused};
+        walk_subtree(process_id, WALK_POST, state_collect_visitor, &collect);
+    }
+
+    // Send SIGCONT to paused processes (T state)
+    for (int i = 0; i < paused.count; i++)
+    {
+        if (kill(paused.pids[i], SIGCONT) == -1)
+        {
+            perror("Failed to continue process");
+        }
+        else
+        {
+            pid_set_add(&resumed, paused.pids[i]);
+            write_labeled_pid("Resumed process", paused.pids[i]);
+        }
+    }
+
+    // Confirm that they are all running again
+    char *running = malloc(resumed.count + 1);
+    if (running != NULL)
+    {
+        if (wait_for_pids(&resumed, NULL, WAIT_CONTINUED, running) > 0)
+        {
+            for (int i = 0; i < resumed.count; i++)
+            {
+                if (!running[i])
+                {
+                    write_text("Process %d did not resume within %d ms\n", resumed.pids[i], signal_timeout_ms);
+                }
+            }
+        }
+        free(running);
+    }
+
+    pid_set_free(&resumed);
+    pid_set_free(&paused);
+}
+
+// Send SIGKILL to one process. With --pidfd the signal goes through a pidfd
+// that was checked against the snapshot, so a recycled PID is left alone.
+int kill_process(int pid)
+{
+    struct proc_entry *entry = find_process(pid);
+    if (!use_pidfd || entry == NULL)
+    {
+        return kill(pid, SIGKILL);
+    }
+
+    int fd = open_checked_pidfd(entry);
+    if (fd == -2)
+    {
+        errno = ESRCH; // The process we saw is gone
+        return -1;
+    }
+
+    int result = send_signal(fd, pid, SIGKILL);
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    return result;
+}
+
+// Function to kill a specific process and handle zombies
+void kill_root_process(int root_process, int process_id)
+{
+    // Ensure the root process is valid
+    if (!is_root_process(root_process))
+    {
+        write_text("Error: %d is not a root process\n", root_process);
+        return;
+    }
+
+    // Check if the process_id belongs to the tree rooted at root_process
+    if (!is_process_in_tree(root_process, process_id))
+    {
+        write_text("Error: Process %d does not belong to the tree rooted at %d\n", process_id, root_process);
+        return;
+    }
+
+    // Check if the process is a zombie
+    if (is_zombie(process_id))
+    {
+        // Get the parent PID of the zombie process
+        int parent_pid = get_parent_pid(process_id);
+
+        // Kill the parent of the zombie
+        if (parent_pid > 1 && kill_process(parent_pid) == -1)
+        {
+            perror("Failed to kill parent");
+        }
+        else
+        {
+            write_text("Killed parent %d of zombie process %d\n", parent_pid, process_id);
+        }
+
+        // Zombie will be cleaned up by init after killing its parent
+    }
+    else
+    {
+        // Kill non-zombie processes directly
+        if (kill_process(process_id) == -1)
+        {
+            perror("Failed to kill process");
+        }
+        else
+        {
+            write_labeled_pid("Killed process", process_id);
+        }
+    }
+}
+
+// Resource usage of one process, and of its subtree once rolled up
+struct usage
+{
+    int pid;
+    unsigned long long cpu_ticks; // User plus system time
+    long rss_pages;               // Resident pages, from statm
+    long threads;
+    long fds;                     // Open file descriptors, 0 if we may not look
+    int processes;                // Processes counted, 1 before rolling up
+};
+
+// Read the usage of one process from stat, statm and its fd directory
+void read_usage(int pid, struct usage *usage)
+{
+    memset(usage, 0, sizeof(*usage));
+    usage->pid = pid;
+    usage->processes = 1;
+
+    char text[512];
+    if (read_proc_file(pid, 0, "stat", text, sizeof(text)) > 0 && strrchr(text, ')') != NULL)
+    {
+        // Fields 14 and 15 are the CPU times and field 20 the thread count,
+        // counting the state right after the name as field 3
+        const char *cursor = strrchr(text, ')') + 2;
+        for (int field = 3; field <= 13; field++)
+        {
+            cursor = skip_stat_field(cursor);
+        }
+        usage->cpu_ticks = take_number(&cursor);
+        usage->cpu_ticks += take_number(&cursor);
+        for (int field = 16; field <= 19; field++)
+        {
+            cursor = skip_stat_field(cursor);
+        }
+        usage->threads = take_number(&cursor);
+    }
+
+    // statm: total program size, then resident pages
+    if (read_proc_file(pid, 0, "statm", text, sizeof(text)) > 0)
+    {
+        const char *cursor = text;
+        cursor = skip_stat_field(cursor);
+        usage->rss_pages = take_number(&cursor);
+    }
+
+    int fd = open_proc_file(pid, 0, "fd");
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (dir == NULL)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return; // Another user's process, or gone
+    }
+    struct dirent *dir_entry;
+    while ((dir_entry = readdir(dir)) != NULL)
+    {
+        usage->fds += dir_entry->d_name[0] != '.';
+    }
+    closedir(dir);
+}
+
+// Biggest subtree RSS first, then lowest PID
+int compare_usage(const void *a, const void *b)
+{
+    const struct usage *left = a;
+    const struct usage *right = b;
+    if (left->rss_pages != right->rss_pages)
+    {
+        return left->rss_pages < right->rss_pages ? 1 : -1;
+    }
+    return left->pid - right->pid;
+}
+
+// Add the usage of a subtree into the totals of its parent
+void add_usage(struct usage *total, struct usage *part)
+{
+    total->cpu_ticks += part->cpu_ticks;
+    total->rss_pages += part->rss_pages;
+    total->threads += part->threads;
+    total->fds += part->fds;
+    total->processes += part->processes;
+}
+
+// Post-order walk for -ru over a subtree the tour did not number. The
+// children of a process finish right before it does, so their totals are the
+// entries on top of the pending stack that are deeper than the process.
+struct usage_walk
+{
+    struct usage *usage; // One entry per process, in visiting order
+    int *depth;          // Depth of each entry
+    int *pending;        // Entries not yet added into their parent
+    int pending_count;
+    int count;
+    int capacity;
+    int failed;          // 1 if memory ran out
+};
+
+// Visitor: read a process, then fold its finished children into it
+int usage_visitor(struct walk_step *step, void *context)
+{
+    struct usage_walk *walk = context;
+    if (walk->count == walk->capacity)
+    {
+        int capacity = walk->capacity == 0 ? 64 : walk->capacity * 2;
+        struct usage *usage = realloc(walk->usage, capacity * sizeof(struct usage));
+        if (usage != NULL)
+        {
+            walk->usage = usage;
+        }
+        int *depth = realloc(walk->depth, capacity * sizeof(int));
+        if (depth != NULL)
+        {
+            walk->depth = depth;
+        }
+        int *pending = realloc(walk->pending, capacity * sizeof(int));
+        if (pending != NULL)
+        {
+            walk->pending = pending;
+        }
+        if (usage == NULL || depth == NULL || pending == NULL)
+        {
+            walk->failed = 1;
+            return 1;
+        }
+        walk->capacity = capacity;
+    }
+
+    struct usage *usage = &walk->usage[walk->count];
+    read_usage(step->entry->pid, usage);
+    while (walk->pending_count > 0 && walk->depth[walk->pending[walk->pending_count - 1]] > step->depth)
+    {
+        add_usage(usage, &walk->usage[walk->pending[--walk->pending_count]]);
+    }
+    walk->depth[walk->count] = step->depth;
+    walk->pending[walk->pending_count++] = walk->count++;
+    return 0;
+}
+
+// -ru: roll CPU, RSS, threads and fds up to every process below process_id
+// and print the top_count biggest subtrees. The tour lists the subtree in
+// pre-order, so walking it backwards reaches every child before its parent:
+// one pass that adds each slot into its parent's slot gives all the totals.
+void list_subtree_usage(int process_id)
+{
+    // Usage is read live, a saved tree may not match the running processes
+    if (snapshot_file != NULL)
+    {
+        write_text("ERROR:Option -ru needs live processes, not a snapshot file\n");
+        return;
+    }
+
+    struct proc_entry *top = find_process(process_id);
+    if (top == NULL)
+    {
+        write_text("Could not read the process tree of %d\n", process_id);
+        return;
+    }
+
+    struct usage *usage = NULL;
+    int count = 0;
+    if (tour_ready() && top->enter != -1)
+    {
+        count = top->leave - top->enter + 1;
+        usage = malloc(count * sizeof(struct usage));
+        for (int i = 0; usage != NULL && i < count; i++)
+        {
+            read_usage(columns.pid[top->enter + i], &usage[i]);
+        }
+
+        for (int i = count - 1; usage != NULL && i > 0; i--)
+        {
+            struct proc_entry *parent = snapshot_lookup(columns.ppid[top->enter + i]);
+            add_usage(&usage[parent->enter - top->enter], &usage[i]);
+        }
+    }
+    else
+    {
+        // The tour did not reach this process, add up along the links instead
+        struct usage_walk walk = {0};
+        walk_subtree(process_id, WALK_POST | WALK_INCLUDE_ROOT, usage_visitor, &walk);
+        free(walk.depth);
+        free(walk.pending);
+        usage = walk.failed ? NULL : walk.usage;
+        count = walk.count;
+        if (walk.failed)
+        {
+            free(walk.usage);
+        }
+    }
+    if (usage == NULL)
+    {
+        write_text("Out of memory while adding up resource usage\n");
+        return;
+    }
+
+    qsort(usage, count, sizeof(struct usage), compare_usage);
+    long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    long ticks = sysconf(_SC_CLK_TCK);
+    write_text("%-8s %-16s %10s %12s %8s %8s %8s\n", "PID", "COMM", "PROCESSES", "RSS_KB", "CPU_S", "THREADS", "FDS");
+    for (int i = 0; i < count && i < top_count; i++)
+    {
+        struct proc_entry *entry = snapshot_lookup(usage[i].pid);
+        write_text("%-8d %-16s %10d %12ld %8.2f %8ld %8ld\n", usage[i].pid, entry->comm, usage[i].processes,
+                   usage[i].rss_pages * page_kb, (double)usage[i].cpu_ticks / ticks, usage[i].threads, usage[i].fds);
+    }
+    free(usage);
+}
+
+// Filter expressions (--where). An expression such as
+//     state == Z && pcomm == java
+//     state == T and age > 10m
+// is compiled once into a flat program in postfix order: every comparison
+// pushes its result on a small stack, and/or/not combine the top entries. The
+// -f options then run the program over the tour slots of the subtree in one
+// loop, reading the columns directly and the table only for names, ages and
+// owners.
+
+enum filter_field
+{
+    FIELD_PID,
+    FIELD_PPID,
+    FIELD_STATE,
+    FIELD_COMM,
+    FIELD_PCOMM, // Name of the parent
+    FIELD_UID,
+    FIELD_AGE,   // Seconds since the process started
+    FIELD_RSS,   // Kilobytes
+    FIELD_DEPTH  // 1 for children of the process asked about, 2 for grandchildren, ...
+};
+
+enum filter_op
+{
+    FILTER_TEST,
+    FILTER_AND,
+    FILTER_OR,
+    FILTER_NOT
+};
+
+enum filter_compare
+{
+    COMPARE_EQ,
+    COMPARE_NE,
+    COMPARE_LT,
+    COMPARE_LE,
+    COMPARE_GT,
+    COMPARE_GE
+};
+
+#define FILTER_MAX 64 // Instructions, and so also the deepest stack
+
+struct filter_instruction
+{
+    unsigned char op;      // enum filter_op
+    unsigned char field;   // enum filter_field, for FILTER_TEST
+    unsigned char compare; // enum filter_compare, for FILTER_TEST
+    long long number;      // Value to compare numeric fields and states with
+    char text[16];         // Value to compare names with
+};
+
+struct filter
+{
+    struct filter_instruction code[FILTER_MAX];
+    int length;
+    int fields;            // Bit per enum filter_field the program reads
+};
+
+struct filter where;       // Compiled --where expression
+const char *where_text = NULL;
+
+// Tokenizer state while compiling
+struct filter_parser
+{
+    const char *cursor;
+    char token[32];
+    const char *error;
+};
+
+// Read the next token: a word, a number, or an operator
+void filter_next(struct filter_parser *parser)
+{
+    const char *cursor = parser->cursor;
+    while (*cursor == ' ' || *cursor == '\t')
+    {
+        cursor++;
+    }
+
+    int length = 0;
+    const char *operators[] = {"==", "!=", "<=", ">=", "&&", "||", "<", ">", "=", "!", "(", ")"};
+    for (int i = 0; i < (int)(sizeof(operators) / sizeof(operators[0])) && length == 0; i++)
+    {
+        if (strncmp(cursor, operators[i], strlen(operators[i])) == 0)
+        {
+            length = strlen(operators[i]);
+        }
+    }
+    if (length == 0)
+    {
+        while (cursor[length] != '\0' && strchr(" \t=!<>&|()", cursor[length]) == NULL)
+        {
+            length++;
+        }
+    }
+    if (length == 0 && *cursor != '\0')
+    {
+        // A lone & or |: never let it read as the end of the expression
+        parser->error = "unknown operator";
+        length = 1;
+    }
+    if (length >= (int)sizeof(parser->token))
+    {
+        parser->error = "word too long";
+        length = sizeof(parser->token) - 1;
+    }
+    memcpy(parser->token, cursor, length);
+    parser->token[length] = '\0';
+    parser->cursor = cursor + length;
+}
+
+// Add one instruction, returns it or NULL if the program is full
+struct filter_instruction *filter_emit(struct filter *filter, struct filter_parser *parser, int op)
+{
+    if (filter->length == FILTER_MAX)
+    {
+        parser->error = "expression too long";
+        return NULL;
+    }
+    struct filter_instruction *instruction = &filter->code[filter->length++];
+    memset(instruction, 0, sizeof(*instruction));
+    instruction->op = op;
+    return instruction;
+}
+
+// Turn the value of a comparison into what the field is compared with
+int filter_value(struct filter_instruction *instruction, const char *value)
+{
+    if (instruction->field == FIELD_COMM || instruction->field == FIELD_PCOMM)
+    {
+        snprintf(instruction->text, sizeof(instruction->text), "%s", value);
+        return value[0] != '\0' && (instruction->compare == COMPARE_EQ || instruction->compare == COMPARE_NE);
+    }
+    if (instruction->field == FIELD_STATE)
+    {
+        const char *names[] = {"zombie", "Z", "stopped", "T", "running", "R", "sleeping", "S"};
+        instruction->number = value[0];
+        for (int i = 0; i < 8; i += 2)
+        {
+            if (strcmp(value, names[i]) == 0)
+            {
+                instruction->number = names[i + 1][0];
+            }
+        }
+        return value[0] != '\0' && (value[1] == '\0' || instruction->number != value[0]);
+    }
+
+    char *unit;
+    instruction->number = strtoll(value, &unit, 10);
+    if (unit == value)
+    {
+        return 0;
+    }
+    long long scale = 1;
+    if (instruction->field == FIELD_AGE)
+    {
+        scale = *unit == 'm' ? 60 : *unit == 'h' ? 3600 : *unit == 'd' ? 86400 : *unit == 's' || *unit == '\0' ? 1 : 0;
+    }
+    else if (instruction->field == FIELD_RSS)
+    {
+        scale = *unit == 'm' || *unit == 'M' ? 1024 : *unit == 'g' || *unit == 'G' ? 1024 * 1024 : *unit == 'k' || *unit == 'K' || *unit == '\0' ? 1 : 0;
+    }
+    else if (*unit != '\0')
+    {
+        scale = 0;
+    }
+    if (*unit != '\0' && unit[1] != '\0' && !(unit[1] == 'b' || unit[1] == 'B'))
+    {
+        scale = 0;
+    }
+    instruction->number *= scale;
+    return scale != 0;
+}
+
+int filter_parse_or(struct filter *filter, struct filter_parser *parser);
+
+// A comparison, a negation or a parenthesized expression
+int filter_parse_unary(struct filter *filter, struct filter_parser *parser)
+{
+    if (strcmp(parser->token, "!") == 0 || strcmp(parser->token, "not") == 0)
+    {
+        filter_next(parser);
+        return filter_parse_unary(filter, parser) && filter_emit(filter, parser, FILTER_NOT) != NULL;
+    }
+    if (strcmp(parser->token, "(") == 0)
+    {
+        filter_next(parser);
+        if (!filter_parse_or(filter, parser))
+        {
+            return 0;
+        }
+        if (strcmp(parser->token, ")") != 0)
+        {
+            parser->error = "missing )";
+            return 0;
+        }
+        filter_next(parser);
+        return 1;
+    }
+
+    const char *fields[] = {"pid", "ppid", "state", "comm", "pcomm", "uid", "age", "rss", "depth"};
+    int field = -1;
+    for (int i = 0; i < (int)(sizeof(fields) / sizeof(fields[0])); i++)
+    {
+        if (strcmp(parser->token, fields[i]) == 0)
+        {
+            field = i;
+        }
+    }
+    if (field == -1)
+    {
+        parser->error = "expected one of pid, ppid, state, comm, pcomm, uid, age, rss, depth";
+        return 0;
+    }
+    filter_next(parser);
+
+    const char *compares[] = {"==", "!=", "<", "<=", ">", ">="};
+    int compare = strcmp(parser->token, "=") == 0 ? COMPARE_EQ : -1;
+    for (int i = 0; i < 6; i++)
+    {
+        if (strcmp(parser->token, compares[i]) == 0)
+        {
+            compare = i;
+        }
+    }
+    if (compare == -1)
+    {
+        parser->error = "expected a comparison (==, !=, <, <=, >, >=)";
+        return 0;
+    }
+    filter_next(parser);
+
+    struct filter_instruction *test = filter_emit(filter, parser, FILTER_TEST);
+    if (test == NULL)
+    {
+        return 0;
+    }
+    test->field = field;
+    test->compare = compare;
+    if (!filter_value(test, parser->token))
+    {
+        parser->error = "bad value for this field";
+        return 0;
+    }
+    filter->fields |= 1 << field;
+    filter_next(parser);
+    return 1;
+}
+
+int filter_parse_and(struct filter *filter, struct filter_parser *parser)
+{
+    if (!filter_parse_unary(filter, parser))
+    {
+        return 0;
+    }
+    while (strcmp(parser->token, "&&") == 0 || strcmp(parser->token, "and") == 0)
+    {
+        filter_next(parser);
+        if (!filter_parse_unary(filter, parser) || filter_emit(filter, parser, FILTER_AND) == NULL)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int filter_parse_or(struct filter *filter, struct filter_parser *parser)
+{
+    if (!filter_parse_and(filter, parser))
+    {
+        return 0;
+    }
+    while (strcmp(parser->token, "||") == 0 || strcmp(parser->token, "or") == 0)
+    {
+        filter_next(parser);
+        if (!filter_parse_and(filter, parser) || filter_emit(filter, parser, FILTER_OR) == NULL)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Compile an expression, returns 0 and prints why if it is not valid
+int filter_compile(struct filter *filter, const char *text)
+{
+    struct filter_parser parser = {text, "", NULL};
+    memset(filter, 0, sizeof(*filter));
+    filter_next(&parser);
+    if (!filter_parse_or(filter, &parser) || parser.error != NULL || parser.token[0] != '\0' || *parser.cursor != '\0')
+    {
+        printf("ERROR:--where: %s near \"%s\"\n", parser.error != NULL ? parser.error : "unexpected word", parser.token);
+        return 0;
+    }
+    return 1;
+}
+
+// What one process looks like to the program. The tour loop fills it from
+// the columns; the table entry is only looked up for names and ages.
+struct filter_subject
+{
+    int pid;
+    int ppid;
+    char state;
+    long rss;
+    int depth;
+    long long boot_seconds;
+    long ticks_per_second;
+    long page_kb;
+};
+
+long long filter_field_value(int field, struct filter_subject *subject)
+{
+    switch (field)
+    {
+    case FIELD_PID:
+        return subject->pid;
+    case FIELD_PPID:
+        return subject->ppid;
+    case FIELD_STATE:
+        return subject->state;
+    case FIELD_RSS:
+        return subject->rss * subject->page_kb;
+    case FIELD_DEPTH:
+        return subject->depth;
+    case FIELD_AGE:
+    {
+        struct proc_entry *entry = snapshot_lookup(subject->pid);
+        return entry == NULL ? 0 : subject->boot_seconds - (long long)(entry->start_time / subject->ticks_per_second);
+    }
+    case FIELD_UID:
+    {
+        // The owner of /proc/<pid> is the process's user
+        char path[16];
+        struct stat info;
+        *put_number(path, subject->pid) = '\0';
+        return fstatat(get_proc_fd(), path, &info, 0) == 0 ? (long long)info.st_uid : -1;
+    }
+    }
+    return 0;
+}
+
+// Run the program for one process
+int filter_matches(struct filter *filter, struct filter_subject *subject)
+{
+    char stack[FILTER_MAX];
+    int top = 0;
+
+    for (int i = 0; i < filter->length; i++)
+    {
+        struct filter_instruction *instruction = &filter->code[i];
+        switch (instruction->op)
+        {
+        case FILTER_AND:
+            top--;
+            stack[top - 1] = stack[top - 1] && stack[top];
+            break;
+        case FILTER_OR:
+            top--;
+            stack[top - 1] = stack[top - 1] || stack[top];
+            break;
+        case FILTER_NOT:
+            stack[top - 1] = !stack[top - 1];
+            break;
+        case FILTER_TEST:
+            if (instruction->field == FIELD_COMM || instruction->field == FIELD_PCOMM)
+            {
+                struct proc_entry *entry = snapshot_lookup(instruction->field == FIELD_COMM ? subject->pid : subject->ppid);
+                int same = entry != NULL && strcmp(entry->comm, instruction->text) == 0;
+                stack[top++] = instruction->compare == COMPARE_EQ ? same : !same;
+                break;
+            }
+
+            long long value = filter_field_value(instruction->field, subject);
+            long long wanted = instruction->number;
+            switch (instruction->compare)
+            {
+            case COMPARE_EQ:
+                stack[top++] = value == wanted;
+                break;
+            case COMPARE_NE:
+                stack[top++] = value != wanted;
+                break;
+            case COMPARE_LT:
+                stack[top++] = value < wanted;
+                break;
+            case COMPARE_LE:
+                stack[top++] = value <= wanted;
+                break;
+            case COMPARE_GT:
+                stack[top++] = value > wanted;
+                break;
+            default:
+                stack[top++] = value >= wanted;
+                break;
+            }
+            break;
+        }
+    }
+    return top == 1 && stack[0];
+}
+
+// Data shared by collect_filtered and its walk visitor
+struct filter_collect
+{
+    struct filter_subject *subject;
+    struct pid_set *found;
+};
+
+// Visitor: run the program for one descendant the tour did not number
+int filter_visitor(struct walk_step *step, void *context)
+{
+    struct filter_collect *collect = context;
+    struct filter_subject *subject = collect->subject;
+    subject->pid = step->entry->pid;
+    subject->ppid = step->entry->ppid;
+    subject->state = step->entry->state;
+    subject->rss = step->entry->rss;
+    subject->depth = step->depth;
+    if (filter_matches(&where, subject))
+    {
+        pid_set_add(collect->found, subject->pid);
+    }
+    return 0;
+}
+
+// Run --where over every descendant of process_id, adding the matches to
+// found in depth first order. Returns 0 (after saying why) if it cannot run.
+int collect_filtered(int process_id, struct pid_set *found)
+{
+    if (where_text == NULL)
+    {
+        write_text("ERROR:This option needs a filter, given with --where EXPRESSION\n");
+        return 0;
+    }
+    if (snapshot_file != NULL && (where.fields & (1 << FIELD_UID)))
+    {
+        write_text("ERROR:uid needs live processes, not a snapshot file\n");
+        return 0;
+    }
+    if (snapshot_file != NULL && (where.fields & (1 << FIELD_AGE)))
+    {
+        // Ages are measured against this machine's boot clock, not the capture's
+        write_text("ERROR:age needs live processes, not a snapshot file\n");
+        return 0;
+    }
+
+    struct filter_subject subject = {0};
+    subject.ticks_per_second = sysconf(_SC_CLK_TCK);
+    subject.page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    struct timespec boot;
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    subject.boot_seconds = boot.tv_sec;
+
+    // Processes the tour did not reach are walked through the table instead
+    struct proc_entry *top = find_process(process_id);
+    int *open = top != NULL && tour_ready() && top->enter != -1 ? malloc((top->leave - top->enter + 2) * sizeof(int)) : NULL;
+    if (open == NULL)
+    {
+        struct filter_collect collect = {&subject, found};
+        walk_subtree(process_id, WALK_PRE, filter_visitor, &collect);
+        return 1;
+    }
+
+    // Depth comes from a stack of the leave numbers of the open ancestors:
+    // an ancestor is closed once the slot is past its subtree
+    int open_count = 0;
+    open[open_count++] = top->leave;
+
+    for (int slot = top->enter + 1; slot <= top->leave; slot++)
+    {
+        while (open[open_count - 1] < slot)
+        {
+            open_count--;
+        }
+        subject.pid = columns.pid[slot];
+        subject.ppid = columns.ppid[slot];
+        subject.state = columns.state[slot];
+        subject.rss = columns.rss[slot];
+        subject.depth = open_count;
+        open[open_count++] = columns.leave[slot];
+
+        if (filter_matches(&where, &subject))
+        {
+            pid_set_add(found, subject.pid);
+        }
+    }
+    free(open);
+    return 1;
+}
+
+// -fl: list the descendants matching --where
+void list_filtered_descendants(int process_id)
+{
+    struct pid_set found = {0};
+    if (collect_filtered(process_id, &found))
+    {
+        if (found.count == 0)
+        {
+            write_text("No descendants of %d match the filter\n", process_id);
+        }
+        for (int i = 0; i < found.count; i++)
+        {
+            if (i == 0)
+            {
+                write_text("Matching descendants:\n");
+            }
+            write_pid(found.pids[i]);
+        }
+    }
+    pid_set_free(&found);
+}
+
+// -fc: count the descendants matching --where
+void count_filtered_descendants(int process_id)
+{
+    struct pid_set found = {0};
+    if (collect_filtered(process_id, &found))
+    {
+        write_count(found.count);
+    }
+    pid_set_free(&found);
+}
+
+// -fk, -fs and -fr: send SIGKILL, SIGSTOP or SIGCONT to the descendants
+// matching --where, then wait until they have exited, stopped or resumed
+void signal_filtered_descendants(int process_id, int sig)
+{
+    struct pid_set found = {0};
+    struct pid_set signalled = {0};
+    if (!collect_filtered(process_id, &found))
+    {
+        pid_set_free(&found);
+        return;
+    }
+
+    const char *label = sig == SIGKILL ? "Killed process" : sig == SIGSTOP ? "Stopped process" : "Resumed process";
+    int wanted = sig == SIGKILL ? WAIT_EXITED : sig == SIGSTOP ? WAIT_STOPPED : WAIT_CONTINUED;
+    for (int i = 0; i < found.count; i++)
+    {
+        int pid = found.pids[i];
+        if (sig != SIGCONT && is_defunct(pid))
+        {
+            write_text("Zombie process detected: PID = %d (Cannot signal a zombie)\n", pid);
+            continue;
+        }
+        int result = sig == SIGKILL ? kill_process(pid) : kill(pid, sig);
+        if (result == -1)
+        {
+            write_text("Failed to signal process %d: %s\n", pid, strerror(errno));
+            continue;
+        }
+        pid_set_add(&signalled, pid);
+        write_labeled_pid(label, pid);
+    }
+
+    char *done = malloc(signalled.count + 1);
+    if (done != NULL)
+    {
+        if (wait_for_pids(&signalled, NULL, wanted, done) > 0)
+        {
+            for (int i = 0; i < signalled.count; i++)
+            {
+                if (!done[i])
+                {
+                    write_text("Process %d did not react within %d ms\n", signalled.pids[i], signal_timeout_ms);
+                }
+            }
+        }
+        free(done);
+    }
+
+    pid_set_free(&signalled);
+    pid_set_free(&found);
+}
+
+// Global flags that take the next word as their value
+int global_flag_takes_value(const char *arg)
+{
+    const char *flags[] = {"--threads", "--timeout", "--reconcile", "--max-age", "--format",
+                           "--top", "--history", "--from", "--where"};
+    for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); i++)
+    {
+        if (strcmp(arg, flags[i]) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Take the global flags out of argv so main only sees the root, pid and option.
+// Returns 0 if a flag was given a bad value.
+int parse_global_flags(int *argc, char *argv[])
+{
+    int kept = 1;
+    for (int i = 1; i < *argc; i++)
+    {
+        // A value flag as the last word would otherwise be kept as a positional argument
+        if (global_flag_takes_value(argv[i]) && i + 1 >= *argc)
+        {
+            printf("ERROR:%s needs a value\n", argv[i]);
+            return 0;
+        }
+        if (strcmp(argv[i], "--threads") == 0)
+        {
+            scan_threads = atoi(argv[++i]);
+            if (scan_threads <= 0)
+            {
+                printf("ERROR:--threads needs a positive number\n");
+                return 0;
+            }
+        }
+        else if (strcmp(argv[i], "--timeout") == 0)
+        {
+            signal_timeout_ms = atoi(argv[++i]);
+            if (signal_timeout_ms <= 0)
+            {
+                printf("ERROR:--timeout needs a positive number of milliseconds\n");
+                return 0;
+            }
+        }
+        else if (strcmp(argv[i], "--pidfd") == 0)
+        {
+            use_pidfd = 1;
+        }
+        else if (strcmp(argv[i], "--reconcile") == 0)
+        {
+            reconcile_seconds = atoi(argv[++i]);
+            if (reconcile_seconds <= 0)
+            {
+                printf("ERROR:--reconcile needs a positive number of seconds\n");
+                return 0;
+            }
+        }
+        else if (strcmp(argv[i], "--max-age") == 0)
+        {
+            server_max_age_ms = atoi(argv[++i]);
+            if (server_max_age_ms < 0)
+            {
+                printf("ERROR:--max-age needs a number of milliseconds\n");
+                return 0;
+            }
+        }
+        else if (strcmp(argv[i], "--scan-times") == 0)
+        {
+            show_scan_times = 1;
+        }
+        else if (strcmp(argv[i], "--format") == 0)
+        {
+            i++;
+            if (strcmp(argv[i], "plain") == 0)
+            {
+                out.format = FORMAT_PLAIN;
+            }
+            else if (strcmp(argv[i], "json") == 0)
+            {
+                out.format = FORMAT_JSON;
+            }
+            else if (strcmp(argv[i], "ndjson") == 0)
+            {
+                out.format = FORMAT_NDJSON;
+            }
+            else
+            {
+                printf("ERROR:--format is plain, json or ndjson\n");
+                return 0;
+            }
+        }
+        else if (strcmp(argv[i], "--top") == 0)
+        {
+            top_count = atoi(argv[++i]);
+            if (top_count <= 0)
+            {
+                printf("ERROR:--top needs a positive number\n");
+                return 0;
+            }
+        }
+        else if (strcmp(argv[i], "--all-tasks") == 0)
+        {
+            all_tasks = 1;
+        }
+        else if (strcmp(argv[i], "--ppid-links") == 0)
+        {
+            ppid_links = 1;
+        }
+        else if (strcmp(argv[i], "--io-uring") == 0)
+        {
+            use_uring = 1;
+        }
+        else if (strcmp(argv[i], "--where") == 0)
+        {
+            where_text = argv[++i];
+            if (!filter_compile(&where, where_text))
+            {
+                return 0;
+            }
+        }
+        else if (strcmp(argv[i], "--history") == 0)
+        {
+            history_slots = atoi(argv[++i]);
+            if (history_slots <= 0)
+            {
+                printf("ERROR:--history needs a positive number of samples\n");
+                return 0;
+            }
+        }
+        else if (strcmp(argv[i], "--from") == 0)
+        {
+            snapshot_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            show_stats = 1;
+        }
+        else
+        {
+            argv[kept++] = argv[i]; // Not a global flag, keep it
+        }
+    }
+    argv[kept] = NULL;
+    *argc = kept;
+    return 1;
+}
+
+// Answer one query: check the processes, then run the option on them.
+// option is NULL when no option was given. Returns the exit status.
+// Options that only read the process tree. The query server answers these and
+// nothing that sends signals, since any local user may be able to connect, and
+// they are all a snapshot file can answer.
+int is_read_only_option(const char *option)
+{
+    const char *read_only[] = {"-id", "-ds", "-lg", "-gc", "-do", "-lz", "-df", "-dc", "-so", "-op", "-ru", "-fl", "-fc"};
+    if (option == NULL)
+    {
+        return 1;
+    }
+    for (int i = 0; i < (int)(sizeof(read_only) / sizeof(read_only[0])); i++)
+    {
+        if (strcmp(option, read_only[i]) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int run_query(pid_t root_process, pid_t process_id, const char *option)
+{
+    // Signals need live processes, not a saved picture of them
+    if (snapshot_file != NULL && !is_read_only_option(option))
+    {
+        write_text("ERROR:Option %s cannot be used with a snapshot file\n", option);
+        return EXIT_FAILURE;
+    }
+
+    // First check if process exists
+    if (!does_process_exist(process_id))
+    {
+        write_text("Process %d doesn't exist!\n", process_id);
+        return EXIT_FAILURE;
+    }
+
+    // Special handling for -so option
+    if (option != NULL && strcmp(option, "-so") == 0)
+    {
+        check_if_orphan(process_id);
+        return EXIT_SUCCESS;
+    }
+    // Special handling for -op option: orphans have been adopted by init, which
+    // is never a tree root, so like -so it is answered before the membership check
+    if (option != NULL && strcmp(option, "-op") == 0)
+    {
+        list_orphan_descendants(process_id);
+        return EXIT_SUCCESS;
+    }
+
+    // Now check tree membership for all other options
+    if (!is_process_in_tree(root_process, process_id))
+    {
+        write_text("Process %d does not belong to the tree rooted at %d\n", process_id, root_process);
+        return EXIT_FAILURE;
+    }
+
+    if (!is_root_process(root_process))
+    {
+        write_text("Process %d is not the root process\n", process_id);
+        return EXIT_FAILURE;
+    }
+
+    // If no option provided, print PID and PPID
+    if (option == NULL)
+    {
+        write_text("Process %d exists!\n", process_id);
+        write_text("PPid: %d\n", get_parent_pid(process_id));
+        write_text("PID %d belongs to tree rooted at %d\n", process_id, root_process);
+        return EXIT_SUCCESS;
+    }
+
+    // If -id option is provided
+    if (option != NULL && strcmp(option, "-id") == 0)
+    {
+        list_immediate_descendants(process_id);
+    }
+
+    // If -ds option is provided
+    if (option != NULL && strcmp(option, "-ds") == 0)
+    {
+        list_non_direct_descendants(process_id);
+    }
+
+    // If -lg option is provided
+    if (option != NULL && strcmp(option, "-lg") == 0)
+    {
+        list_siblings(process_id);
+    }
+
+    // If -lg option is provided
+    if (option != NULL && strcmp(option, "-gc") == 0)
+    {
+        list_grandchildren(process_id);
+    }
+
+    // If -do option is provided
+    if (option != NULL && strcmp(option, "-do") == 0)
+    {
+        check_if_defunct(process_id);
+    }
+
+    // If -lz option is provided
+    if (option != NULL && strcmp(option, "-lz") == 0)
+    {
+        list_defunct_siblings(process_id);
+    }
+
+    // If -df option is provided
+    if (option != NULL && strcmp(option, "-df") == 0)
+    {
+        list_defunct_descendants(process_id);
+    }
+
+    // If -dc option is provided
+    if (option != NULL && strcmp(option, "-dc") == 0)
+    {
+        count_defunct_descendants(process_id);
+    }
+
+    // If -so option is provided
+    if (option != NULL && strcmp(option, "-so") == 0)
+    {
+        check_if_orphan(process_id);
+    }
+
+    // If -ru option is provided
+    if (option != NULL && strcmp(option, "-ru") == 0)
+    {
+        list_subtree_usage(process_id);
+    }
+
+    // If -fl option is provided
+    if (option != NULL && strcmp(option, "-fl") == 0)
+    {
+        list_filtered_descendants(process_id);
+    }
+
+    // If -fc option is provided
+    if (option != NULL && strcmp(option, "-fc") == 0)
+    {
+        count_filtered_descendants(process_id);
+    }
+
+    // If -fk, -fs or -fr option is provided
+    if (option != NULL && strcmp(option, "-fk") == 0)
+    {
+        signal_filtered_descendants(process_id, SIGKILL);
+    }
+    if (option != NULL && strcmp(option, "-fs") == 0)
+    {
+        signal_filtered_descendants(process_id, SIGSTOP);
+    }
+    if (option != NULL && strcmp(option, "-fr") == 0)
+    {
+        signal_filtered_descendants(process_id, SIGCONT);
+    }
+
+    // If -pz option is provided
+    if (option != NULL && strcmp(option, "--pz") == 0)
+    {
+        kill_parents_of_zombies(process_id);
+    }
+
+    // If -sk option is provided
+    if (option != NULL && strcmp(option, "-sk") == 0)
+    {
+        if (!is_root_process(root_process))
+        {
+            write_text("Error: %d is not a root process\n", root_process);
+            return EXIT_FAILURE;
+        }
+
+        kill_all_descendants(process_id);
+    }
+
+    // If -st option is provide
+    if (option != NULL && strcmp(option, "-st") == 0)
+    {
+        if (!is_root_process(root_process))
+        {
+            write_text("Error: %d is not a root process\n", root_process);
+            return EXIT_FAILURE;
+        }
+
+        stop_all_descendants(process_id);
+    }
+
+    // If -sc option is provide
+    if (option != NULL && strcmp(option, "-dt") == 0)
+    {
+        if (!is_root_process(root_process))
+        {
+            write_text("Error: %d is not a root process\n", root_process);
+            return EXIT_FAILURE;
+        }
+
+        continue_all_paused_descendants(process_id);
+    }
+
+    // If -rp option is provide
+    if (option != NULL && strcmp(option, "-rp") == 0)
+    {
+        
+        if (process_id != root_process) {
+            write_text("Only root process have to be killed using -rp\n");
+            return EXIT_FAILURE;
+        }
+        kill_root_process(root_process, root_process);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Open a netlink socket that receives fork/exec/exit events from the kernel's
+// process connector. Needs CAP_NET_ADMIN. Returns -1 on failure.
+int open_proc_events(void)
+{
+    int sock = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+    if (sock == -1)
+    {
+        return -1;
+    }
+
+    struct sockaddr_nl address;
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = CN_IDX_PROC;
+    if (bind(sock, (struct sockaddr *)&address, sizeof(address)) == -1)
+    {
+        close(sock);
+        return -1;
+    }
+
+    // Ask the kernel to start sending us events
+    char request[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))];
+    memset(request, 0, sizeof(request));
+    struct nlmsghdr *header = (struct nlmsghdr *)request;
+    header->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op));
+    header->nlmsg_type = NLMSG_DONE;
+    header->nlmsg_pid = getpid();
+
+    struct cn_msg *message = NLMSG_DATA(header);
+    message->id.idx = CN_IDX_PROC;
+    message->id.val = CN_VAL_PROC;
+    message->len = sizeof(enum proc_cn_mcast_op);
+    *(enum proc_cn_mcast_op *)message->data = PROC_CN_MCAST_LISTEN;
+
+    if (send(sock, request, header->nlmsg_len, 0) == -1)
+    {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// A process that has exited, checked again until its zombie is reaped
+struct pending_exit
+{
+    int pid;
+    double give_up_ms; // Stop checking after this time, reconcile will catch it
+};
+
+// Processes that exited recently
+struct pending_exit *pending_exits = NULL;
+int pending_count = 0;
+int pending_capacity = 0;
+
+// Remember an exited process so we can check on it shortly
+void add_pending_exit(int pid)
+{
+    if (pending_count == pending_capacity)
+    {
+        int new_capacity = pending_capacity ? pending_capacity * 2 : 64;
+        struct pending_exit *grown = realloc(pending_exits, new_capacity * sizeof(struct pending_exit));
+        if (grown == NULL)
+        {
+            return; // The next reconcile will catch it
+        }
+        pending_exits = grown;
+        pending_capacity = new_capacity;
+    }
+    pending_exits[pending_count].pid = pid;
+    pending_exits[pending_count].give_up_ms = now_ms() + 1000;
+    pending_count++;
+}
+
+// Check on recently exited processes. Their children have been reparented by
+// now, and zombies that were reaped are dropped from the index.
+void process_pending_exits(void)
+{
+    double now = now_ms();
+    int kept = 0;
+
+    for (int i = 0; i < pending_count; i++)
+    {
+        int pid = pending_exits[i].pid;
+        struct proc_entry *entry = snapshot_lookup(pid);
+        if (entry == NULL)
+        {
+            continue;
+        }
+
+        // Move the children to their new parent (init or a subreaper)
+        int child = entry->first_child;
+        while (child != -1)
+        {
+            int next = snapshot.entries[child].next_sibling;
+            snapshot_refresh_parent(snapshot.entries[child].pid);
+            child = next;
+        }
+
+        char state = get_live_state(pid);
+        if (state == 0)
+        {
+            snapshot_remove(pid); // Reaped
+        }
+        else if (now < pending_exits[i].give_up_ms)
+        {
+            pending_exits[kept++] = pending_exits[i]; // Still a zombie, look again later
+        }
+    }
+    pending_count = kept;
+}
+
+// Apply one process event to the live index
+void apply_proc_event(struct proc_event *event)
+{
+    switch (event->what)
+    {
+    case PROC_EVENT_FORK:
+        // Only new processes, not new threads
+        if (event->event_data.fork.child_pid == event->event_data.fork.child_tgid)
+        {
+            snapshot_add(event->event_data.fork.child_tgid);
+        }
+        break;
+
+    case PROC_EVENT_EXEC:
+    case PROC_EVENT_COMM:
+    {
+        // The name changed, read it again
+        struct proc_entry *entry = snapshot_lookup(event->event_data.exec.process_tgid);
+        struct proc_entry now;
+        if (entry != NULL && read_stat_entry(entry->pid, &now))
+        {
+            memcpy(entry->comm, now.comm, sizeof(entry->comm));
+        }
+        break;
+    }
+
+    case PROC_EVENT_EXIT:
+        // Only the whole process, not single threads
+        if (event->event_data.exit.process_pid == event->event_data.exit.process_tgid)
+        {
+            struct proc_entry *entry = snapshot_lookup(event->event_data.exit.process_tgid);
+            if (entry != NULL)
+            {
+                snapshot_set_state(entry, 'Z'); // Dead until its parent reaps it
+                add_pending_exit(entry->pid);
+            }
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+// Read all waiting events from the netlink socket.
+// Returns 0 if the kernel dropped events and we have to rescan.
+int read_proc_events(int sock)
+{
+    // Netlink messages must be read into an aligned buffer
+    long buffer[1024];
+
+    while (1)
+    {
+        int length = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (length == -1)
+        {
+            return errno != ENOBUFS; // ENOBUFS means the kernel dropped events
+        }
+
+        for (struct nlmsghdr *header = (struct nlmsghdr *)buffer; NLMSG_OK(header, (unsigned int)length); header = NLMSG_NEXT(header, length))
+        {
+            if (header->nlmsg_type == NLMSG_ERROR || header->nlmsg_type == NLMSG_NOOP)
+            {
+                continue;
+            }
+            struct cn_msg *message = NLMSG_DATA(header);
+            if (message->id.idx == CN_IDX_PROC && message->id.val == CN_VAL_PROC)
+            {
+                // The event sits right after the 20 byte cn_msg header, which
+                // leaves it misaligned: copy it out before reading its fields
+                struct proc_event event;
+                memset(&event, 0, sizeof(event));
+                memcpy(&event, message->data, message->len < sizeof(event) ? message->len : sizeof(event));
+                apply_proc_event(&event);
+            }
+        }
+    }
+}
+
+// Split a query line like "1004 1005 -df" into its parts and answer it.
+// Returns the exit status the same query would have on the command line.
+int answer_query_line(char *line, int read_only)
+{
+    char *words[4];
+    int count = 0;
+    for (char *word = strtok(line, " \t\r"); word != NULL && count < 4; word = strtok(NULL, " \t\r"))
+    {
+        words[count++] = word;
+    }
+
+    pid_t root_process = count > 0 ? atoi(words[0]) : 0;
+    pid_t process_id = count > 1 ? atoi(words[1]) : 0;
+    char *option = count == 3 ? words[2] : NULL;
+    int status = EXIT_FAILURE;
+    output_begin(root_process, process_id, option);
+
+    if (count < 2 || count > 3)
+    {
+        write_text("ERROR:Queries look like <root_process> <process_id> [Option]\n");
+    }
+    else if (process_id <= 0 || root_process <= 0)
+    {
+        write_text("ERROR:Process IDs should be a positive number\n");
+    }
+    else if (read_only && !is_read_only_option(option))
+    {
+        write_text("ERROR:Option %s is not available through the query server\n", option);
+    }
+    else
+    {
+        status = run_query(root_process, process_id, option);
+    }
+
+    output_end(status);
+    return status;
+}
+
+// Batch mode: answer many queries, one per line, from a file or stdin against
+// a single snapshot. Returns failure if any of the queries failed.
+int run_batch(const char *path)
+{
+    FILE *input = stdin;
+    if (path != NULL && strcmp(path, "-") != 0)
+    {
+        input = fopen(path, "r");
+        if (input == NULL)
+        {
+            perror(path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!snapshot_build())
+    {
+        return EXIT_FAILURE;
+    }
+    batch_mode = 1;
+    out.as_array = 1; // JSON: all answers in one array
+
+    int status = EXIT_SUCCESS;
+    char *line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, input) != -1)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[strspn(line, " \t\r")] == '\0')
+        {
+            continue; // Skip blank lines
+        }
+        if (answer_query_line(line, 0) != EXIT_SUCCESS)
+        {
+            status = EXIT_FAILURE;
+        }
+    }
+
+    output_finish();
+    free(line);
+    if (input != stdin)
+    {
+        fclose(input);
+    }
+    return status;
+}
 
+// Watch mode: keep the process index up to date from kernel events and answer
+// queries read from stdin, one per line, until stdin is closed.
+int run_watch(void)
+{
+    if (!snapshot_build())
+    {
+        return EXIT_FAILURE;
+    }
+    live_index = 1;
 
-// Function to check if process exists or not
-int does_process_exist(int pid)
+    int sock = open_proc_events();
+    if (sock == -1)
+    {
+        fprintf(stderr, "Cannot subscribe to process events (%s), rescanning every %d seconds instead\n",
+                strerror(errno), reconcile_seconds);
+    }
+
+    char input[4096];
+    int input_length = 0;
+    double next_reconcile = now_ms() + reconcile_seconds * 1000.0;
+
+    while (1)
+    {
+        struct pollfd polls[2];
+        int poll_count = 0;
+        polls[poll_count].fd = STDIN_FILENO;
+        polls[poll_count++].events = POLLIN;
+        if (sock != -1)
+        {
+            polls[poll_count].fd = sock;
+            polls[poll_count++].events = POLLIN;
+        }
+
+        // Wake up in time for the next rescan, or soon if exits are pending
+        int timeout = (int)(next_reconcile - now_ms());
+        if (pending_count > 0 && timeout > 20)
+        {
+            timeout = 20;
+        }
+        if (poll(polls, poll_count, timeout < 0 ? 0 : timeout) == -1 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+
+        // Events first, so queries see the latest state
+        if (sock != -1 && (polls[1].revents & POLLIN) && !read_proc_events(sock))
+        {
+            next_reconcile = 0; // Events were lost, rescan right away
+        }
+        process_pending_exits();
+
+        if (now_ms() >= next_reconcile)
+        {
+            snapshot_build();
+            pending_count = 0;
+            next_reconcile = now_ms() + reconcile_seconds * 1000.0;
+        }
+
+        if (polls[0].revents & (POLLIN | POLLHUP))
+        {
+            int length = read(STDIN_FILENO, input + input_length, sizeof(input) - 1 - input_length);
+            if (length <= 0)
+            {
+                break; // stdin closed, we are done
+            }
+            input_length += length;
+
+            // Answer every complete line
+            char *line = input;
+            char *end;
+            while ((end = memchr(line, '\n', input + input_length - line)) != NULL)
+            {
+                *end = '\0';
+                answer_query_line(line, 0);
+                output_flush();
+                line = end + 1;
+            }
+
+            // Keep the unfinished line for next time
+            input_length -= line - input;
+            memmove(input, line, input_length);
+            if (input_length == sizeof(input) - 1)
+            {
+                input_length = 0; // A line this long is not a query
+            }
+        }
+    }
+
+    if (sock != -1)
+    {
+        close(sock);
+    }
+    return EXIT_SUCCESS;
+}
+
+// Query server: answers the same queries as the command line over a Unix
+// socket, so clients skip the /proc scan and reuse one warm process index.
+// A request is one line "<root_process> <process_id> [Option]", the reply is a
+// header line "<exit status> <body length>" followed by the body.
+
+#define SERVER_LISTEN 1
+#define SERVER_EVENTS 2
+#define SERVER_CLIENT 3
+
+// One file descriptor watched by the server; epoll hands it back to us
+struct server_conn
+{
+    int fd;
+    int kind;              // SERVER_LISTEN, SERVER_EVENTS or SERVER_CLIENT
+    char input[1024];      // Unfinished request line
+    int input_length;
+    char *output;          // Replies not sent yet
+    size_t output_length;
+    size_t output_sent;
+    size_t output_capacity;
+};
+
+// Queue bytes for a client, returns 0 if we ran out of memory
+int server_queue(struct server_conn *conn, const char *data, size_t length)
 {
-    // First, we will make a string to store the file path
-    char file_path[100]; // Make it big enough to hold the path
+    if (conn->output_length + length > conn->output_capacity)
+    {
+        size_t capacity = conn->output_capacity == 0 ? 4096 : conn->output_capacity;
+        while (capacity < conn->output_length + length)
+        {
+            capacity *= 2;
+        }
+        char *grown = realloc(conn->output, capacity);
+        if (grown == NULL)
+        {
+            return 0;
+        }
+        conn->output = grown;
+        conn->output_capacity = capacity;
+    }
+    memcpy(conn->output + conn->output_length, data, length);
+    conn->output_length += length;
+    return 1;
+}
 
-    // Creating the path string like "/proc/1234/status"
-    sprintf(file_path, "/proc/%d/status", pid);
+// Answer one request line, capturing everything the query prints
+int server_answer(struct server_conn *conn, char *line)
+{
+    // The server's output stays in memory, so the answer is the whole buffer
+    out.buffer.length = 0;
+    int status = answer_query_line(line, 1);
+
+    char header[64];
+    int header_length = snprintf(header, sizeof(header), "%d %zu\n", status, out.buffer.length);
+    int queued = server_queue(conn, header, header_length) && server_queue(conn, out.buffer.data, out.buffer.length);
+    out.buffer.length = 0;
+    return queued;
+}
 
-    // Try to open the file
-    FILE *file = fopen(file_path, "r"); // "r" means read mode
-    if (file == NULL)
+// Send as much queued output as the socket takes. Returns -1 if the client is
+// gone, 1 if output is still waiting, 0 once everything was sent.
+int server_flush(struct server_conn *conn)
+{
+    while (conn->output_sent < conn->output_length)
     {
-        return 0; // File didn't open, so process doesn't exist
+        ssize_t sent = send(conn->fd, conn->output + conn->output_sent,
+                            conn->output_length - conn->output_sent, MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 1;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        conn->output_sent += sent;
     }
+    conn->output_length = 0;
+    conn->output_sent = 0;
+    return 0;
+}
 
-    // If we got here, file opened okay
-    fclose(file); // close file after reading
+// Read requests from a client and answer every complete line.
+// Returns 0 when the client should be closed.
+int server_read(struct server_conn *conn)
+{
+    while (1)
+    {
+        ssize_t length = read(conn->fd, conn->input + conn->input_length,
+                              sizeof(conn->input) - 1 - conn->input_length);
+        if (length == 0)
+        {
+            return 0; // Client hung up
+        }
+        if (length == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn->input_length += length;
 
-    // Process exists
+        char *line = conn->input;
+        char *end;
+        while ((end = memchr(line, '\n', conn->input + conn->input_length - line)) != NULL)
+        {
+            *end = '\0';
+            if (!server_answer(conn, line))
+            {
+                return 0;
+            }
+            line = end + 1;
+        }
+
+        conn->input_length -= line - conn->input;
+        memmove(conn->input, line, conn->input_length);
+        if (conn->input_length == sizeof(conn->input) - 1)
+        {
+            return 0; // A line this long is not a query
+        }
+    }
+}
+
+void server_close(int epoll_fd, struct server_conn *conn)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn->output);
+    free(conn);
+}
+
+// Fill in a Unix socket address, returns 0 if the path is too long
+int make_socket_address(const char *path, struct sockaddr_un *address)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path))
+    {
+        printf("ERROR:Socket path %s is too long\n", path);
+        return 0;
+    }
+    strcpy(address->sun_path, path);
     return 1;
 }
 
-// Function to get pid of the parent process
-int get_parent_pid(int pid)
+int run_server(const char *path)
 {
-    // Make a string to store file path
-    char file_path[100];
+    struct sockaddr_un address;
+    if (!make_socket_address(path, &address) || !snapshot_build())
+    {
+        return EXIT_FAILURE;
+    }
+    live_index = 1;
 
-    // Make a string to store each line we read
-    char line[256];
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1)
+    {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+    unlink(path); // Left over from a server that did not shut down cleanly
+    if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(listen_fd, SOMAXCONN) == -1)
+    {
+        perror(path);
+        close(listen_fd);
+        return EXIT_FAILURE;
+    }
 
-    // Create the path to status file
-    sprintf(file_path, "/proc/%d/status", pid);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+    {
+        perror("epoll_create1");
+        close(listen_fd);
+        return EXIT_FAILURE;
+    }
 
-    // Try to open the file
-    FILE *file = fopen(file_path, "r");
+    struct server_conn listener = {.fd = listen_fd, .kind = SERVER_LISTEN};
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = &listener};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
 
-    // Check if file opened okay
-    if (file == NULL)
+    // Kernel events keep the index current; without them we rescan when stale.
+    // A snapshot file has no events, it is simply mapped again.
+    struct server_conn events = {.fd = snapshot_file == NULL ? open_proc_events() : -1, .kind = SERVER_EVENTS};
+    if (events.fd == -1 && snapshot_file == NULL)
+    {
+        fprintf(stderr, "Cannot subscribe to process events (%s), rescanning snapshots older than %d ms\n",
+                strerror(errno), server_max_age_ms);
+    }
+    else
     {
-        printf("Cannot open status file for process %d\n", pid);
-        return -1; // Return -1 if we couldn't open file
+        event.data.ptr = &events;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, events.fd, &event);
     }
 
-    // Variable to store parent pid when we find it
-    int ppid = -1;
+    signal(SIGPIPE, SIG_IGN);
+    out.fd = -1; // Answers are collected in memory and sent to each client
+    fprintf(stderr, "Answering queries on %s\n", path);
+    double next_reconcile = now_ms() + reconcile_seconds * 1000.0;
 
-    // Read file line by line
-    while (fgets(line, sizeof(line), file))
+    while (1)
     {
-        // Check if this line starts with "PPid:"
-        if (strncmp(line, "PPid:", 5) == 0)
+        int timeout = (int)(next_reconcile - now_ms());
+        if (pending_count > 0 && timeout > 20)
         {
-            // Found the line with parent PID
-            // Convert the text after "PPid:" to a number
-            sscanf(line, "PPid: %d", &ppid);
-            break; // Exit the loop, we found what we needed
+            timeout = 20;
+        }
+
+        struct epoll_event ready[64];
+        int ready_count = epoll_wait(epoll_fd, ready, 64, timeout < 0 ? 0 : timeout);
+        if (ready_count == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
         }
-    }
 
-    // printf("PPid: %d\n", ppid);
+        // Events first, so the replies below see the latest state
+        for (int i = 0; i < ready_count; i++)
+        {
+            struct server_conn *conn = ready[i].data.ptr;
+            if (conn->kind == SERVER_EVENTS && !read_proc_events(conn->fd))
+            {
+                next_reconcile = 0; // Events were lost, rescan right away
+            }
+        }
+        process_pending_exits();
 
-    // Close the file
-    fclose(file);
+        if (now_ms() >= next_reconcile ||
+            (events.fd == -1 && now_ms() - snapshot.built_ms > server_max_age_ms))
+        {
+            snapshot_build();
+            pending_count = 0;
+            next_reconcile = now_ms() + reconcile_seconds * 1000.0;
+        }
 
-    // Return the parent pid we found
-    return ppid;
+        for (int i = 0; i < ready_count; i++)
+        {
+            struct server_conn *conn = ready[i].data.ptr;
+            if (conn->kind == SERVER_LISTEN)
+            {
+                int client_fd;
+                while ((client_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+                {
+                    struct server_conn *client = calloc(1, sizeof(*client));
+                    if (client == NULL)
+                    {
+                        close(client_fd);
+                        continue;
+                    }
+                    client->fd = client_fd;
+                    client->kind = SERVER_CLIENT;
+                    struct epoll_event client_event = {.events = EPOLLIN, .data.ptr = client};
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &client_event) == -1)
+                    {
+                        close(client_fd);
+                        free(client);
+                    }
+                }
+            }
+            else if (conn->kind == SERVER_CLIENT)
+            {
+                int open = 1;
+                if (ready[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                {
+                    open = server_read(conn);
+                }
+
+                // Whatever was answered goes out now; a slow reader gets the rest on EPOLLOUT
+                int waiting = server_flush(conn);
+                if (waiting == -1 || (!open && waiting == 0))
+                {
+                    server_close(epoll_fd, conn);
+                    continue;
+                }
+                struct epoll_event client_event = {.events = waiting ? EPOLLOUT : EPOLLIN, .data.ptr = conn};
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &client_event);
+            }
+        }
+    }
+
+    close(epoll_fd);
+    close(listen_fd);
+    if (events.fd != -1)
+    {
+        close(events.fd);
+    }
+    unlink(path);
+    return EXIT_FAILURE;
 }
 
-int is_process_in_tree(int root_process, int process_id)
+// Thin client: send one query to a server and print its answer as if the
+// query had run locally, exiting with the same status.
+int run_client(const char *path, int argc, char *argv[])
 {
-    // First check if both processes exist
-    if (!does_process_exist(root_process) || !does_process_exist(process_id))
+    struct sockaddr_un address;
+    if (!make_socket_address(path, &address))
     {
-        printf("One or both processes don't exist\n");
-        return 0;
+        return EXIT_FAILURE;
     }
 
-    // Start with the process we want to check
-    int current_pid = process_id;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1)
+    {
+        perror(path);
+        return EXIT_FAILURE;
+    }
 
-    // Keep going up the tree until we either find root_process or reach init
-    while (current_pid > 1)
-    { // 1 is the init process
-        // If we found the root_process, we're done!
-        if (current_pid == root_process)
+    char request[256];
+    int request_length = snprintf(request, sizeof(request), "%s %s%s%s\n",
+                                  argv[0], argv[1], argc == 3 ? " " : "", argc == 3 ? argv[2] : "");
+    if (request_length >= (int)sizeof(request) || write(fd, request, request_length) != request_length)
+    {
+        printf("ERROR:Could not send the query\n");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    shutdown(fd, SHUT_WR);
+
+    // Header first, then copy the body straight through
+    char header[64];
+    int header_length = 0;
+    while (header_length < (int)sizeof(header) - 1)
+    {
+        if (read(fd, header + header_length, 1) != 1)
         {
-            return 1;
+            break;
+        }
+        if (header[header_length++] == '\n')
+        {
+            break;
         }
+    }
+    header[header_length] = '\0';
 
-        // Get the parent of current process
-        int parent_pid = get_parent_pid(current_pid);
+    int status;
+    size_t body_length;
+    if (sscanf(header, "%d %zu", &status, &body_length) != 2)
+    {
+        printf("ERROR:No answer from %s\n", path);
+        close(fd);
+        return EXIT_FAILURE;
+    }
 
-        // If we couldn't get parent PID, something went wrong
-        if (parent_pid == -1)
+    char buffer[4096];
+    while (body_length > 0)
+    {
+        ssize_t length = read(fd, buffer, body_length < sizeof(buffer) ? body_length : sizeof(buffer));
+        if (length <= 0)
         {
-            printf("Couldn't get parent for process %d\n", current_pid);
-            return 0;
+            printf("ERROR:Answer from %s was cut short\n", path);
+            close(fd);
+            return EXIT_FAILURE;
         }
+        fwrite(buffer, 1, length, stdout);
+        body_length -= length;
+    }
+    close(fd);
+    return status;
+}
 
-        // Move up to the parent
-        current_pid = parent_pid;
+// Read every stat file in /proc over and over, once with the plain reader
+// that fills the snapshot for get_parent_pid, is_defunct and the rest, and
+// once through io_uring, and compare the time and system calls per pass
+int run_read_benchmark(void)
+{
+    struct arena scratch = {0};
+    int *pids;
+    int pid_count = list_proc_pids(&scratch, &pids);
+    if (pid_count < 0 || get_proc_fd() == -1)
+    {
+        arena_free(&scratch);
+        return EXIT_FAILURE;
+    }
+    int runs = 50;
+
+    // Plain reader: openat, read and close per file, only openat if it fails
+    struct proc_entry entry;
+    long calls = 0;
+    int read_ok = 0;
+    double started = now_ms();
+    for (int run = 0; run < runs; run++)
+    {
+        read_ok = 0;
+        for (int i = 0; i < pid_count; i++)
+        {
+            int ok = read_stat_entry(pids[i], &entry);
+            calls += ok ? 3 : 1;
+            read_ok += ok;
+        }
     }
+    printf("plain reader %8.3f ms per pass, %7ld system calls per pass, %d of %d files\n",
+           (now_ms() - started) / runs, calls / runs, read_ok, pid_count);
 
-    // If we got here, we reached init without finding root_process
-    return 0;
+    // io_uring: one io_uring_enter per batch
+    struct uring ring;
+    if (!uring_open(&ring))
+    {
+        printf("io_uring     not available: %s\n", strerror(errno));
+        arena_free(&scratch);
+        return EXIT_SUCCESS;
+    }
+    char stats[URING_BATCH][URING_STAT_SIZE];
+    int lengths[URING_BATCH];
+    started = now_ms();
+    for (int run = 0; run < runs; run++)
+    {
+        read_ok = 0;
+        for (int batch = 0; batch < pid_count; batch += URING_BATCH)
+        {
+            int count = pid_count - batch < URING_BATCH ? pid_count - batch : URING_BATCH;
+            if (!uring_read_stats(&ring, &pids[batch], count, stats, lengths))
+            {
+                perror("io_uring_enter");
+                uring_close(&ring);
+                arena_free(&scratch);
+                return EXIT_FAILURE;
+            }
+            for (int i = 0; i < count; i++)
+            {
+                read_ok += lengths[i] >= 0 && fill_stat_entry(pids[batch + i], stats[i], &entry);
+            }
+        }
+    }
+    printf("io_uring     %8.3f ms per pass, %7ld system calls per pass, %d of %d files\n",
+           (now_ms() - started) / runs, ring.enters / runs, read_ok, pid_count);
+
+    uring_close(&ring);
+    arena_free(&scratch);
+    return EXIT_SUCCESS;
 }
 
-// Helper function to verify if a process is root of its tree
-int is_root_process(int pid)
+// Time a full scan with each way of linking the table: reading every
+// children file, or inverting the parent PIDs from the stat files
+int run_build_benchmark(void)
 {
-    char status_path[256];
-    sprintf(status_path, "/proc/%d/status", pid);
+    const char *names[] = {"children files", "parent PIDs"};
+    int runs = 20;
 
-    FILE *status_file = fopen(status_path, "r");
-    if (status_file == NULL)
+    for (int mode = 0; mode < 2; mode++)
     {
-        return 0;
+        if (mode == 0 && children_files_missing())
+        {
+            printf("%-15s not available on this kernel\n", names[mode]);
+            continue;
+        }
+        ppid_links = mode;
+
+        double best = 0;
+        double total = 0;
+        for (int run = 0; run < runs; run++)
+        {
+            double started = now_ms();
+            if (!snapshot_build())
+            {
+                return EXIT_FAILURE;
+            }
+            double elapsed = now_ms() - started;
+            total += elapsed;
+            best = run == 0 || elapsed < best ? elapsed : best;
+        }
+
+        int links = 0;
+        for (int i = 0; i < snapshot.count; i++)
+        {
+            for (struct proc_entry *child = first_child_of(&snapshot.entries[i]); child != NULL; child = next_sibling_of(child))
+            {
+                links++;
+            }
+        }
+        printf("%-15s %8.3f ms per scan (best %.3f ms), %d processes, %d parent links\n",
+               names[mode], total / runs, best, snapshot.count, links);
+    }
+    return EXIT_SUCCESS;
+}
+
+// Layout benchmark: count the zombies below the root of a synthetic tree by
+// walking the child links, by scanning a table of structs in tour order and by
+// scanning the state column with each state kernel, at several tree sizes.
+int run_layout_benchmark(void)
+{
+    int sizes[] = {10000, 100000, 1000000};
+    srand(1);
+
+    for (int s = 0; s < 3; s++)
+    {
+        int n = sizes[s];
+
+        // Random tree: each process gets a parent among the ones made before it
+        snapshot_free();
+        snapshot.entries = arena_alloc(&snapshot.memory, n * sizeof(struct proc_entry));
+        snapshot.index = arena_alloc(&snapshot.memory, (n + 1) * sizeof(int));
+        struct proc_entry *ordered = malloc(n * sizeof(struct proc_entry));
+        if (snapshot.entries == NULL || snapshot.index == NULL || ordered == NULL)
+        {
+            perror("Out of memory for the benchmark tree");
+            free(ordered);
+            return EXIT_FAILURE;
+        }
+        memset(snapshot.entries, 0, n * sizeof(struct proc_entry));
+        snapshot.capacity = n;
+        snapshot.max_pid = n;
+        snapshot.index[0] = -1;
+        for (int i = 0; i < n; i++)
+        {
+            struct proc_entry *entry = &snapshot.entries[i];
+            entry->pid = i + 1;
+            entry->ppid = i == 0 ? 0 : 1 + rand() % i;
+            entry->state = rand() % 100 == 0 ? 'Z' : 'S';
+            entry->rss = rand() % 10000;
+            entry->first_child = -1;
+            entry->next_sibling = -1;
+            snapshot.index[i + 1] = i;
+        }
+        snapshot.count = n;
+        snapshot.loaded = 1;
+        for (int i = 1; i < n; i++)
+        {
+            snapshot_link(i);
+        }
+        tree_generation++;
+        if (!tour_ready())
+        {
+            free(ordered);
+            return EXIT_FAILURE;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            ordered[snapshot.entries[i].enter] = snapshot.entries[i];
+        }
+
+        // Every method scans about 100 million processes in total
+        int repeats = 100000000 / n;
+        volatile int sink = 0;
+
+        double started = now_ms();
+        for (int r = 0; r < repeats / 10; r++)
+        {
+            struct defunct_check check = {0, 0};
+            walk_subtree(1, WALK_PRE, check_defunct_visitor, &check);
+            sink = check.count;
+        }
+        double walk_ns = (now_ms() - started) * 1e6 / ((double)(repeats / 10) * n);
+
+        started = now_ms();
+        for (int r = 0; r < repeats; r++)
+        {
+            int count = 0;
+            for (int slot = 1; slot < n; slot++)
+            {
+                count += ordered[slot].state == 'Z';
+            }
+            sink = count;
+        }
+        double structs_ns = (now_ms() - started) * 1e6 / ((double)repeats * n);
+
+        printf("%8d processes: walk %.3f ns, structs %.3f ns",
+               n, walk_ns, structs_ns);
+
+        // The state column, once with each kernel this CPU can run
+        pick_state_kernels();
+        const char *best = state_kernel_name;
+        int (*kernels[3])(const char *, int, char) = {count_state_scalar, NULL, NULL};
+        const char *names[3] = {"scalar", "sse2", "avx2"};
+#if defined(__x86_64__) || defined(__i386__)
+        kernels[1] = count_state_sse2;
+        if (strcmp(best, "avx2") == 0)
+        {
+            kernels[2] = count_state_avx2;
+        }
+#endif
+        for (int k = 0; k < 3; k++)
+        {
+            if (kernels[k] == NULL)
+            {
+                continue;
+            }
+            count_state_kernel = kernels[k];
+            started = now_ms();
+            for (int r = 0; r < repeats; r++)
+            {
+                sink = count_state_in_range(1, n - 1, 'Z');
+            }
+            printf(", %s %.3f ns", names[k], (now_ms() - started) * 1e6 / ((double)repeats * n));
+        }
+        pick_state_kernels();
+        printf(" per process (%d zombies, %s picked)\n", sink, best);
+        free(ordered);
     }
 
-    char line[256];
-    int ppid = -1;
+    snapshot_free();
+    return EXIT_SUCCESS;
+}
 
-    // Get parent PID
-    while (fgets(line, sizeof(line), status_file))
+// Write zero bytes up to the next section boundary
+int snapshot_pad(FILE *file, uint64_t *offset)
+{
+    static const char zeros[SNAPSHOT_ALIGN];
+    uint64_t aligned = snapshot_align(*offset);
+    if (fwrite(zeros, 1, aligned - *offset, file) != aligned - *offset)
     {
-        if (strncmp(line, "PPid:", 5) == 0)
-        {
-            sscanf(line, "PPid: %d", &ppid);
-            break;
-        }
+        return 0;
     }
-    fclose(status_file);
+    *offset = aligned;
+    return 1;
+}
 
-    // Check if parent is a bash process
-    char parent_cmdline[256];
-    sprintf(parent_cmdline, "/proc/%d/cmdline", ppid);
-    FILE *cmdline_file = fopen(parent_cmdline, "r");
-    if (cmdline_file == NULL)
+// Write one section and move the offset past it
+int snapshot_section(FILE *file, uint64_t *offset, const void *data, uint64_t size)
+{
+    if (size > 0 && fwrite(data, 1, size, file) != size)
     {
         return 0;
     }
-
-    char cmd[256];
-    fgets(cmd, sizeof(cmd), cmdline_file);
-    fclose(cmdline_file);
-
-    // Check if parent is bash
-    return (strstr(cmd, "bash") != NULL);
+    *offset += size;
+    return snapshot_pad(file, offset);
 }
 
-// function to print immediate descendants of a process
-void list_immediate_descendants(int process_id)
+// prct --save: scan /proc (or load --from) and write the snapshot to a file
+int save_snapshot(const char *path)
 {
-    // Make space for storing the file path
-    char children_path[256];
-
-    // Create path to children file
-    sprintf(children_path, "/proc/%d/task/%d/children", process_id, process_id);
-
-    // Try to open the file
-    FILE *child_file = fopen(children_path, "r");
-
-    // Check if we could open the file
-    if (child_file == NULL)
+    if (!snapshot_build() || !tour_ready())
     {
-        printf("Could not open children file for process %d\n", process_id);
-        return;
+        return EXIT_FAILURE;
     }
 
-    // Variable to store child pid
-    int child_pid;
-    int found_children = 0; // Flag to track if we found any children
-
-    // Read child PIDs one by one
-    while (fscanf(child_file, "%d", &child_pid) > 0)
+    // Gather the command lines, the only thing the queries read besides the table
+    int count = snapshot.count;
+    uint32_t *starts = malloc((count + 1) * sizeof(uint32_t));
+    struct text pool = {0};
+    if (starts == NULL)
     {
-        // If this is first child found, print header
-        if (!found_children)
+        perror("Out of memory while saving the snapshot");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        char cmdline[256];
+        int length = snapshot.entries[i].pid != 0 ? read_cmdline(snapshot.entries[i].pid, cmdline, sizeof(cmdline)) : -1;
+        starts[i] = pool.length;
+        if (length > 0)
         {
-            printf("Immediate descendants of %d:\n", process_id);
-            found_children = 1;
+            text_append(&pool, cmdline, length);
         }
-        printf("%d\n", child_pid);
     }
-
-    // If no children were found
-    if (!found_children)
+    starts[count] = pool.length;
+
+    // Lay the sections out one after the other
+    struct snapshot_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.entry_size = sizeof(struct proc_entry);
+    header.long_size = sizeof(long);
+    header.count = count;
+    header.max_pid = snapshot.max_pid;
+    header.column_count = columns.count;
+    header.saved_at = time(NULL);
+    header.entries_offset = snapshot_align(sizeof(header));
+    header.index_offset = snapshot_align(header.entries_offset + (uint64_t)count * sizeof(struct proc_entry));
+    header.pid_offset = snapshot_align(header.index_offset + ((uint64_t)snapshot.max_pid + 1) * sizeof(int));
+    header.ppid_offset = snapshot_align(header.pid_offset + (uint64_t)count * sizeof(int));
+    header.state_offset = snapshot_align(header.ppid_offset + (uint64_t)count * sizeof(int));
+    header.rss_offset = snapshot_align(header.state_offset + (uint64_t)count);
+    header.leave_offset = snapshot_align(header.rss_offset + (uint64_t)count * sizeof(long));
+    header.cmdline_offset = snapshot_align(header.leave_offset + (uint64_t)count * sizeof(int));
+    header.pool_offset = snapshot_align(header.cmdline_offset + ((uint64_t)count + 1) * sizeof(uint32_t));
+    header.pool_size = pool.length;
+    header.file_size = snapshot_align(header.pool_offset + pool.length);
+
+    // Processes the tour did not reach have no column slot, zero the spare slots
+    int spare = count - columns.count;
+    memset(columns.pid + columns.count, 0, spare * sizeof(int));
+    memset(columns.ppid + columns.count, 0, spare * sizeof(int));
+    memset(columns.state + columns.count, 0, spare);
+    memset(columns.rss + columns.count, 0, spare * sizeof(long));
+    memset(columns.leave + columns.count, 0, spare * sizeof(int));
+
+    FILE *file = fopen(path, "wb");
+    uint64_t offset = 0;
+    int ok = file != NULL &&
+             snapshot_section(file, &offset, &header, sizeof(header)) &&
+             snapshot_section(file, &offset, snapshot.entries, (uint64_t)count * sizeof(struct proc_entry)) &&
+             snapshot_section(file, &offset, snapshot.index, ((uint64_t)snapshot.max_pid + 1) * sizeof(int)) &&
+             snapshot_section(file, &offset, columns.pid, (uint64_t)count * sizeof(int)) &&
+             snapshot_section(file, &offset, columns.ppid, (uint64_t)count * sizeof(int)) &&
+             snapshot_section(file, &offset, columns.state, (uint64_t)count) &&
+             snapshot_section(file, &offset, columns.rss, (uint64_t)count * sizeof(long)) &&
+             snapshot_section(file, &offset, columns.leave, (uint64_t)count * sizeof(int)) &&
+             snapshot_section(file, &offset, starts, ((uint64_t)count + 1) * sizeof(uint32_t)) &&
+             snapshot_section(file, &offset, pool.data, pool.length);
+    if (file == NULL || fclose(file) != 0)
     {
-        printf("No immediate descendants found for process %d\n", process_id);
+        ok = 0;
     }
 
-    // Close the file
-    fclose(child_file);
-}
-
-void list_non_direct_descendants(int process_id)
-{
-    // First get immediate childrem
-    char children_path[256];
-    sprintf(children_path, "/proc/%d/task/%d/children", process_id, process_id);
-
-    FILE *child_file = fopen(children_path, "r");
-    if (child_file == NULL)
+    free(starts);
+    free(pool.data);
+    if (!ok)
     {
-        printf("No non-direct descendants found\n");
-        return;
+        perror(path);
+        return EXIT_FAILURE;
     }
+    printf("Saved %d processes to %s\n", count, path);
+    return EXIT_SUCCESS;
+}
 
-    // Read immediate children first
-    int immediate_child;
-    int found_non_direct = 0; // Flag for non direct descendants
+// Snapshot diff: compare two captures of the process tree (files written by
+// --save, or "-" for a live scan) and report what changed in between.
 
-    // For each immediate child, find their children (which are non-direct for original process)
-    while (fscanf(child_file, "%d", &immediate_child) > 0)
-    {
-        // Now check children for this immediate child
-        char grandchild_path[256];
-        sprintf(grandchild_path, "/proc/%d/task/%d/children", immediate_child, immediate_child);
+// One side of a diff. It owns its table once loaded, so two can exist at once.
+struct diff_side
+{
+    struct proc_snapshot table;
+    int *order; // Table positions sorted by PID
+};
 
-        FILE *grandchild_file = fopen(grandchild_path, "r");
-        if (grandchild_file != NULL)
-        {
-            int grandchild;
-            while (fscanf(grandchild_file, "%d", &grandchild) > 0)
-            {
-                if (!found_non_direct)
-                {
-                    printf("Non-direct descendants of %d: \n", process_id);
-                    found_non_direct = 1;
-                }
-                printf("%d\n", grandchild);
-            }
-            fclose(grandchild_file);
-        }
-    }
-    fclose(child_file);
-    if (!found_non_direct)
-    {
-        printf("No non-direct descendants found.\n");
-    }
-}
+struct proc_entry *diff_entries; // Table the sort below compares in
 
-void list_siblings(int process_id)
+int compare_entry_pids(const void *a, const void *b)
 {
-    // First get the parent ID of our process
-    int parent_pid = get_parent_pid(process_id);
+    return diff_entries[*(const int *)a].pid - diff_entries[*(const int *)b].pid;
+}
 
-    // If we couldn't get parent, return
-    if (parent_pid == -1)
+// Load one side of a diff and take its table out of the global snapshot
+int load_diff_side(const char *source, struct diff_side *side)
+{
+    snapshot_file = strcmp(source, "-") == 0 ? NULL : source;
+    if (!snapshot_build())
     {
-        printf("Could not find parent of process %d\n", process_id);
-        return;
+        return 0;
     }
+    side->table = snapshot;
+    memset(&snapshot, 0, sizeof(snapshot));
+    memset(&columns, 0, sizeof(columns)); // The columns belong to the table we took
+    tour_generation = 0;
 
-    // Now look for all children of this parent (these are siblings)
-    char sibling_path[256];
-    sprintf(sibling_path, "/proc/%d/task/%d/children", parent_pid, parent_pid);
-
-    FILE *sibling_file = fopen(sibling_path, "r");
-    if (sibling_file == NULL)
+    side->order = malloc((side->table.count + 1) * sizeof(int));
+    if (side->order == NULL)
     {
-        printf("No siblings found\n");
-        return;
+        perror("Out of memory while comparing snapshots");
+        return 0;
     }
 
-    // Read all siblings
-    int sibling_pid;
-    int found_siblings = 0;
-
-    while (fscanf(sibling_file, "%d", &sibling_pid) > 0)
+    // /proc lists PIDs in ascending order, so a scan is usually sorted already
+    int sorted = 1;
+    for (int i = 0; i < side->table.count; i++)
     {
-        // Don't list the process itself as its sibling
-        if (sibling_pid != process_id)
+        side->order[i] = i;
+        if (i > 0 && side->table.entries[i].pid < side->table.entries[i - 1].pid)
         {
-            // Print header only when first sibling is found
-            if (!found_siblings)
-            {
-                printf("Siblings of process %d:\n", process_id);
-                found_siblings = 1;
-            }
-            printf("%d\n", sibling_pid);
+            sorted = 0;
         }
     }
-
-    // If no siblings were found (except itself)
-    if (!found_siblings)
+    if (!sorted)
     {
-        printf("No siblings found for process %d\n", process_id);
+        diff_entries = side->table.entries;
+        qsort(side->order, side->table.count, sizeof(int), compare_entry_pids);
     }
-
-    fclose(sibling_file);
+    return 1;
 }
 
-void list_grandchildren(int process_id)
+void free_diff_side(struct diff_side *side)
 {
-    // First get immediate children
-    char children_path[256];
-    sprintf(children_path, "/proc/%d/task/%d/children", process_id, process_id);
-
-    FILE *child_file = fopen(children_path, "r");
-    if (child_file == NULL)
+    if (side->table.mapping != NULL)
     {
-        printf("No grandchildren found (no children)\n");
-        return;
+        munmap(side->table.mapping, side->table.mapping_size);
     }
+    arena_free(&side->table.memory);
+    free(side->order);
+}
 
-    int child_pid;
-    int found_grandchildren = 0; // Flag to track if we found any grandchildren
-
-    // For each child, find their children (our grandchildren)
-    while (fscanf(child_file, "%d", &child_pid) > 0)
+// Find the child of root whose subtree holds pid in one side's table.
+// Returns root for root itself and -1 if pid is not below root at all.
+int diff_subtree_of(struct proc_snapshot *table, int pid, int root)
+{
+    if (pid == root)
     {
-        // Look for children of this child (grandchildren)
-        char grandchild_path[256];
-        sprintf(grandchild_path, "/proc/%d/task/%d/children", child_pid, child_pid);
-
-        FILE *grandchild_file = fopen(grandchild_path, "r");
-        if (grandchild_file != NULL)
-        {
-            int grandchild_pid;
-
-            // Read each grandchild
-            while (fscanf(grandchild_file, "%d", &grandchild_pid) > 0)
-            {
-                // Print header only for first grandchild
-                if (!found_grandchildren)
-                {
-                    printf("Grandchildren of process %d:\n", process_id);
-                    found_grandchildren = 1;
-                }
-                printf("%d\n", grandchild_pid);
-            }
-            fclose(grandchild_file);
-        }
+        return root;
     }
-
-    fclose(child_file);
-
-    // If no grandchildren were found
-    if (!found_grandchildren)
+    for (int hops = 0; pid > 1 && hops < table->count; hops++)
     {
-        printf("No grandchildren found for process %d\n", process_id);
+        if (pid > table->max_pid || table->index[pid] == -1)
+        {
+            return -1;
+        }
+        int parent = table->entries[table->index[pid]].ppid;
+        if (parent == root)
+        {
+            return pid;
+        }
+        pid = parent;
     }
+    return -1;
 }
 
-void check_if_defunct(int process_id)
+// Changes counted for the subtree of one child of the root
+struct diff_subtree
 {
-    // Make space for file path
-    char status_path[256];
-    sprintf(status_path, "/proc/%d/status", process_id);
-
-    // Try to open status file
-    FILE *status_file = fopen(status_path, "r");
-    if (status_file == NULL)
+    int top;     // The child of the root, or the root itself
+    int added;
+    int removed;
+    int reparented;
+    int zombies;
+};
+
+// What one diff found, each list holds PIDs
+struct diff_result
+{
+    struct pid_set added;
+    struct pid_set removed;
+    struct pid_set reparented;
+    struct pid_set zombies;
+    struct diff_subtree *subtrees;
+    int subtree_count;
+    int subtree_capacity;
+};
+
+// Count a change against the subtree it happened in
+void diff_count(struct diff_result *result, int top, int kind)
+{
+    int i = 0;
+    while (i < result->subtree_count && result->subtrees[i].top != top)
     {
-        printf("Cannot open status file for process %d\n", process_id);
-        return;
+        i++;
     }
-
-    // Read file line by line
-    char line[256];
-    int is_defunct = 0; // Flag to track if process is defunct
-
-    while (fgets(line, sizeof(line), status_file))
+    if (i == result->subtree_count)
     {
-        // Look for line starting with "State:"
-        if (strncmp(line, "State:", 6) == 0)
+        if (result->subtree_count == result->subtree_capacity)
         {
-            // Check if state contains 'Z' (zombie/defunct)
-            if (strchr(line, 'Z') != NULL)
+            int new_capacity = result->subtree_capacity ? result->subtree_capacity * 2 : 16;
+            struct diff_subtree *grown = realloc(result->subtrees, new_capacity * sizeof(struct diff_subtree));
+            if (grown == NULL)
             {
-                is_defunct = 1;
+                return;
             }
-            break; // Found state line, no need to read more
+            result->subtrees = grown;
+            result->subtree_capacity = new_capacity;
         }
+        memset(&result->subtrees[i], 0, sizeof(struct diff_subtree));
+        result->subtrees[i].top = top;
+        result->subtree_count++;
     }
 
-    // Print result
-    if (is_defunct)
+    struct diff_subtree *subtree = &result->subtrees[i];
+    if (kind == 'A')
+    {
+        subtree->added++;
+    }
+    else if (kind == 'R')
+    {
+        subtree->removed++;
+    }
+    else if (kind == 'P')
     {
-        printf("Defunct\n");
+        subtree->reparented++;
     }
     else
     {
-        printf("Not defunct\n");
+        subtree->zombies++;
     }
-
-    // Close file
-    fclose(status_file);
 }
 
-void list_defunct_siblings(int process_id)
+// Walk both PID-sorted lists side by side, like the merge step of merge sort
+void diff_merge(struct diff_side *before, struct diff_side *after, int root, struct diff_result *result)
 {
-    // First get the parent ID of our process
-    int parent_pid = get_parent_pid(process_id);
-
-    // If we couldn't get parent, return
-    if (parent_pid == -1)
-    {
-        printf("Could not find parent of process %d\n", process_id);
-        return;
-    }
-
-    // Now look for all children of this parent (these are siblings)
-    char sibling_path[256];
-    sprintf(sibling_path, "/proc/%d/task/%d/children", parent_pid, parent_pid);
+    struct proc_snapshot *old_table = &before->table;
+    struct proc_snapshot *new_table = &after->table;
+    int i = 0;
+    int j = 0;
 
-    FILE *sibling_file = fopen(sibling_path, "r");
-    if (sibling_file == NULL)
+    while (i < old_table->count || j < new_table->count)
     {
-        printf("No defunct siblings found\n");
-        return;
-    }
+        struct proc_entry *old_entry = i < old_table->count ? &old_table->entries[before->order[i]] : NULL;
+        struct proc_entry *new_entry = j < new_table->count ? &new_table->entries[after->order[j]] : NULL;
+        int old_pid = old_entry != NULL ? old_entry->pid : INT_MAX;
+        int new_pid = new_entry != NULL ? new_entry->pid : INT_MAX;
 
-    // Read all siblings
-    int sibling_pid;
-    int found_defunct_siblings = 0;
+        // A PID that was given to a new process counts as one exit and one fork
+        int same = old_pid == new_pid && old_entry->start_time == new_entry->start_time;
 
-    while (fscanf(sibling_file, "%d", &sibling_pid) > 0)
-    {
-        // Don't check the process itself
-        if (sibling_pid != process_id)
+        if (old_pid < new_pid || (old_pid == new_pid && !same))
         {
-            // Check if this sibling is defunct
-            char status_path[256];
-            sprintf(status_path, "/proc/%d/status", sibling_pid);
+            int top = root ? diff_subtree_of(old_table, old_pid, root) : 0;
+            if (top != -1)
+            {
+                pid_set_add(&result->removed, old_pid);
+                diff_count(result, top, 'R');
+            }
+            i++; // A new process with the same PID is handled on the next round
+            continue;
+        }
 
-            FILE *status_file = fopen(status_path, "r");
-            if (status_file != NULL)
+        int top = root ? diff_subtree_of(new_table, new_pid, root) : 0;
+        if (old_pid > new_pid)
+        {
+            if (top != -1)
             {
-                char line[256];
-                while (fgets(line, sizeof(line), status_file))
+                pid_set_add(&result->added, new_pid);
+                diff_count(result, top, 'A');
+                if (new_entry->state == 'Z')
                 {
-                    // Look for State line
-                    if (strncmp(line, "State:", 6) == 0)
-                    {
-                        // Check if zombie
-                        if (strchr(line, 'Z') != NULL)
-                        {
-                            // Print header only for first defunct sibling
-                            if (!found_defunct_siblings)
-                            {
-                                printf("Defunct siblings of process %d:\n", process_id);
-                                found_defunct_siblings = 1;
-                            }
-                            printf("%d\n", sibling_pid);
-                        }
-                        break; // Found state line, no need to read more
-                    }
+                    pid_set_add(&result->zombies, new_pid);
+                    diff_count(result, top, 'Z');
                 }
-                fclose(status_file);
             }
+            j++;
+            continue;
         }
-    }
 
-    // If no defunct siblings were found
-    if (!found_defunct_siblings)
-    {
-        printf("No defunct siblings found for process %d\n", process_id);
+        // Same process in both captures. One that was reparented to init has
+        // already left the subtree in the new capture: credit the change to
+        // the branch it left, or the new orphans would never be reported
+        if (top == -1 && root)
+        {
+            top = diff_subtree_of(old_table, old_pid, root);
+        }
+        if (top != -1)
+        {
+            if (old_entry->ppid != new_entry->ppid)
+            {
+                pid_set_add(&result->reparented, new_pid);
+                diff_count(result, top, 'P');
+            }
+            if (new_entry->state == 'Z' && old_entry->state != 'Z')
+            {
+                pid_set_add(&result->zombies, new_pid);
+                diff_count(result, top, 'Z');
+            }
+        }
+        i++;
+        j++;
     }
-
-    fclose(sibling_file);
 }
 
-// Helper function to check if a process is defunct
-int is_defunct(int pid)
+// Print one list of a diff, with the details from the table the PIDs are in
+void write_diff_list(const char *title, struct pid_set *pids, struct proc_snapshot *table,
+                     struct proc_snapshot *old_table)
 {
-    char status_path[256];
-    sprintf(status_path, "/proc/%d/status", pid);
-
-    FILE *status_file = fopen(status_path, "r");
-    if (status_file == NULL)
-    {
-        return 0;
-    }
-
-    char line[256];
-    int is_defunct = 0;
-
-    while (fgets(line, sizeof(line), status_file))
+    write_text("%s: %d\n", title, pids->count);
+    for (int i = 0; i < pids->count; i++)
     {
-        if (strncmp(line, "State:", 6) == 0)
+        struct proc_entry *entry = &table->entries[table->index[pids->pids[i]]];
+        if (old_table != NULL)
         {
-            if (strchr(line, 'Z') != NULL)
-            {
-                is_defunct = 1;
-            }
-            break;
+            // Reparented: show where it moved from
+            int old_parent = old_table->entries[old_table->index[entry->pid]].ppid;
+            write_text("  %d %s: parent %d -> %d%s\n", entry->pid, entry->comm, old_parent, entry->ppid,
+                       entry->ppid == 1 ? " (new orphan)" : "");
+        }
+        else
+        {
+            write_text("  %d %s (parent %d, state %c)\n", entry->pid, entry->comm, entry->ppid, entry->state);
         }
     }
-    fclose(status_file);
-    return is_defunct;
 }
 
-// Recursive function to check all descendants
-void check_descendants_recursive(int pid, int *count, int print_pids)
+// prct --diff BEFORE AFTER [root_process]
+int run_diff(const char *before_source, const char *after_source, int root)
 {
-    char children_path[256];
-    sprintf(children_path, "/proc/%d/task/%d/children", pid, pid);
-
-    FILE *child_file = fopen(children_path, "r");
-    if (child_file == NULL)
-    {
-        return;
-    }
+    struct diff_side before = {0};
+    struct diff_side after = {0};
+    struct diff_result result = {0};
+    int status = EXIT_FAILURE;
 
-    int child_pid;
-    while (fscanf(child_file, "%d", &child_pid) > 0)
+    if (load_diff_side(before_source, &before) && load_diff_side(after_source, &after))
     {
-        // Check if this child is defunct
-        if (is_defunct(child_pid))
+        double started = now_ms();
+        diff_merge(&before, &after, root, &result);
+        double elapsed = now_ms() - started;
+
+        output_begin(root, root, "--diff");
+        write_text("Compared %d processes with %d in %.3f ms\n", before.table.count, after.table.count, elapsed);
+        write_diff_list("Added", &result.added, &after.table, NULL);
+        write_diff_list("Removed", &result.removed, &before.table, NULL);
+        write_diff_list("Reparented", &result.reparented, &after.table, &before.table);
+        write_diff_list("New zombies", &result.zombies, &after.table, NULL);
+
+        // Which part of the tree the churn came from
+        if (root)
         {
-            (*count)++; // Increment counter
-            if (print_pids)
-            { // Only print if -df option
-                if (*count == 1)
-                { // Print header only once
-                    printf("Defunct descendants:\n");
+            write_text("Per subtree of %d:\n", root);
+            for (int i = 0; i < result.subtree_count; i++)
+            {
+                struct diff_subtree *subtree = &result.subtrees[i];
+                struct proc_snapshot *table = &after.table;
+                if (subtree->top > table->max_pid || table->index[subtree->top] == -1)
+                {
+                    table = &before.table; // The whole subtree is gone
                 }
-                printf("%d\n", child_pid);
+                write_text("  %d %s: +%d -%d, %d reparented, %d new zombies\n", subtree->top,
+                           table->entries[table->index[subtree->top]].comm, subtree->added, subtree->removed,
+                           subtree->reparented, subtree->zombies);
             }
         }
-        // Recursively check this child's descendants
-        check_descendants_recursive(child_pid, count, print_pids);
+        status = EXIT_SUCCESS;
+        output_end(status);
+        output_finish();
     }
 
-    fclose(child_file);
+    pid_set_free(&result.added);
+    pid_set_free(&result.removed);
+    pid_set_free(&result.reparented);
+    pid_set_free(&result.zombies);
+    free(result.subtrees);
+    free_diff_side(&before);
+    free_diff_side(&after);
+    snapshot_file = NULL;
+    return status;
 }
 
-// Function for -df option
-void list_defunct_descendants(int process_id)
-{
-    int count = 0;
-    check_descendants_recursive(process_id, &count, 1); // 1 means print PIDs
-
-    if (count == 0)
-    {
-        printf("No defunct descendants found for process %d\n", process_id);
-    }
-}
+// Sampling mode: at a fixed interval, record counters for the subtree of each
+// watched root into a ring buffer that keeps the last history_slots samples.
+// A sampler thread writes the ring while the main thread answers "dump" and
+// "last N" requests from stdin, without a lock between them.
 
-// Function for -dc option
-void count_defunct_descendants(int process_id)
+// Counters for one subtree at one instant
+struct sample
 {
-    // printf("[DEBUG] Entering count_defunct_descendants for PID: %d\n", process_id);
-    int count = 0;
-    check_descendants_recursive(process_id, &count, 0); // 0 means don't print PIDs
-    printf("%d\n", count);                              // Print the count
-    // printf("[DEBUG] Defunct descendant count for PID %d: %d\n", process_id, count);
-}
-
-void check_if_orphan(int process_id)
+    double time;                  // Seconds since the epoch
+    int root;                     // Root of the subtree
+    int total;                    // Processes in the subtree, root included
+    int zombies;                  // In state Z
+    int stopped;                  // In state T
+    int orphans;                  // Adopted by init (parent PID 1)
+    long rss_pages;               // Summed resident set size
+    unsigned long long cpu_ticks; // Summed user and system time
+};
+
+// One ring slot. number is the sample number plus one once the slot is
+// complete, and 0 while the writer is filling it in.
+struct sample_slot
 {
-    // Get original parent PID
-    int original_ppid = get_parent_pid(process_id);
-
-    // printf("\nIn orphan checking\n");
-    // printf("Got original parent PID: %d\n", original_ppid);
-
-    // If parent is init (PID 1), process is orphan
-    if (original_ppid == 1)
-    {
-        printf("Orphan\n");
-        return;
-    }
+    unsigned long long number;
+    struct sample sample;
+};
 
-    // Try to open parent's status file
-    char parent_path[256];
-    sprintf(parent_path, "/proc/%d/status", original_ppid);
+struct sample_ring
+{
+    struct sample_slot *slots;
+    int size;
+    unsigned long long head; // Samples written so far
+};
 
-    FILE *parent_file = fopen(parent_path, "r");
-    if (parent_file == NULL)
-    {
-        // Can't open parent's status file - parent doesn't exist
-        printf("Orphan\n");
-        return;
-    }
+struct sample_ring ring;
+volatile sig_atomic_t stop_requested = 0; // Set by Ctrl-C in the sampling and view modes
 
-    fclose(parent_file);
-    printf("Not Orphan\n");
+// Writer side: only the sampler thread calls this
+void ring_push(struct sample *sample)
+{
+    unsigned long long number = ring.head;
+    struct sample_slot *slot = &ring.slots[number % ring.size];
+
+    __atomic_store_n(&slot->number, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->sample = *sample;
+    __atomic_store_n(&slot->number, number + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring.head, number + 1, __ATOMIC_RELEASE);
 }
 
-// Helper function to check if a process is orphan
-int is_orphan(int pid)
+// Reader side: copy sample number n, returns 0 if it was overwritten meanwhile
+int ring_read(unsigned long long number, struct sample *sample)
 {
-    char status_path[256];
-    sprintf(status_path, "/proc/%d/status", pid);
-
-    FILE *status_file = fopen(status_path, "r");
-    if (status_file == NULL)
+    struct sample_slot *slot = &ring.slots[number % ring.size];
+    if (__atomic_load_n(&slot->number, __ATOMIC_ACQUIRE) != number + 1)
     {
-        printf("Failed to open status file for PID %d\n", pid); // Debug print
-        return 0;                                               // Process doesn't exist
+        return 0;
     }
+    *sample = slot->sample;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->number, __ATOMIC_RELAXED) == number + 1;
+}
 
-    char line[256];
-    int ppid = -1;
+// What the sampler thread works on
+struct sampler
+{
+    pthread_t thread;
+    int *roots;
+    int root_count;
+    int interval_ms;
+    int limit;           // Ticks to take, 0 for no limit
+    double cpu_ms;       // CPU time the sampler thread used
+    int ticks;
+    int done_fd;         // Write end of a pipe, closed when the thread finishes
+};
+
+// Thread CPU time in milliseconds
+double thread_cpu_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
 
-    // Read the status file to find the parent PID (PPid)
-    while (fgets(line, sizeof(line), status_file))
+// Re-read one process and add it to a sample
+void sample_entry(struct proc_entry *entry, struct sample *sample)
+{
+    struct proc_entry now_entry;
+    if (!read_stat_entry(entry->pid, &now_entry))
     {
-        if (strncmp(line, "PPid:", 5) == 0)
-        {
-            sscanf(line, "PPid: %d", &ppid);
-            break;
-        }
+        return; // Exited since the last event, the next tick will know
     }
-    fclose(status_file);
-
-    printf("PID: %d, PPid: %d\n", pid, ppid); // Debug print
+    snapshot_set_state(entry, now_entry.state);
+    entry->utime = now_entry.utime;
+    entry->stime = now_entry.stime;
+    entry->rss = now_entry.rss;
+
+    sample->total++;
+    sample->zombies += entry->state == 'Z';
+    sample->stopped += entry->state == 'T';
+    sample->orphans += entry->ppid == 1;
+    sample->rss_pages += entry->rss;
+    sample->cpu_ticks += entry->utime + entry->stime;
+}
 
-    // A process is orphaned if its parent PID is 1 (adopted by init)
-    return (ppid == 1);
+// Visitor for subtrees the tour did not number
+int sample_visitor(struct walk_step *step, void *context)
+{
+    sample_entry(step->entry, context);
+    return 0;
 }
 
-// Recursive function to list all orphan descendants
-void list_orphan_descendants(int process_id)
+// Re-read the changing fields of every process below a root and add them up.
+// The table entries are updated in place, so a tick over a numbered subtree
+// allocates nothing.
+void sample_subtree(int root, struct sample *sample)
 {
-    char children_path[256];
-    sprintf(children_path, "/proc/%d/task/%d/children", process_id, process_id);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    memset(sample, 0, sizeof(*sample));
+    sample->time = now.tv_sec + now.tv_nsec / 1e9;
+    sample->root = root;
+
+    struct proc_entry *top = snapshot_lookup(root);
+    if (top == NULL)
+    {
+        return; // The root is gone, record an empty sample
+    }
 
-    FILE *child_file = fopen(children_path, "r");
-    if (child_file == NULL)
+    // A root the tour did not reach (forked by a worker thread of a process
+    // whose children file did not list it) is walked through its links instead
+    if (!tour_ready() || top->enter == -1)
     {
-        printf("Failed to open children file for PID %d\n", process_id); // Debug print
+        walk_subtree(root, WALK_PRE | WALK_INCLUDE_ROOT, sample_visitor, sample);
         return;
     }
 
-    int child_pid;
-
-    while (fscanf(child_file, "%d", &child_pid) > 0)
+    for (int slot = top->enter; slot <= top->leave; slot++)
     {
-        printf("Traversing child PID: %d of parent PID: %d\n", child_pid, process_id); // Debug print
-
-        // Recursively check descendants of this child
-        list_orphan_descendants(child_pid);
-
-        // Check if this child is an orphan
-        if (is_orphan(child_pid))
+        struct proc_entry *entry = snapshot_lookup(columns.pid[slot]);
+        if (entry != NULL)
         {
-            printf("Orphaned descendant: %d\n", child_pid);
+            sample_entry(entry, sample);
         }
     }
-
-    fclose(child_file);
 }
 
-// Helper function to check if a process is zombie
-int is_zombie(int pid)
+// Sampler thread: keep the index current from process events (or rescan
+// when they are not available) and push one sample per root every tick
+void *sampler_run(void *arg)
 {
-    char status_path[256];
-    sprintf(status_path, "/proc/%d/status", pid);
-
-    FILE *status_file = fopen(status_path, "r");
-    if (status_file == NULL)
+    struct sampler *sampler = arg;
+    double cpu_started = thread_cpu_ms();
+    int sock = open_proc_events();
+    if (sock == -1)
     {
-        return 0;
+        fprintf(stderr, "Cannot subscribe to process events (%s), rescanning every tick instead\n", strerror(errno));
     }
 
-    char line[256];
-    while (fgets(line, sizeof(line), status_file))
+    double next_tick = now_ms();
+    int rescan = 1;
+    while (!stop_requested && (sampler->limit == 0 || sampler->ticks < sampler->limit))
     {
-        if (strncmp(line, "State:", 6) == 0)
+        // Between ticks, follow forks and exits
+        int timeout = (int)(next_tick - now_ms());
+        if (sock != -1 && timeout > 0)
+        {
+            struct pollfd events = {sock, POLLIN, 0};
+            if (poll(&events, 1, pending_count > 0 && timeout > 20 ? 20 : timeout) > 0 && !read_proc_events(sock))
+            {
+                rescan = 1; // Events were lost
+            }
+            process_pending_exits();
+            continue;
+        }
+        if (timeout > 0)
         {
-            fclose(status_file);
-            return (strchr(line, 'Z') != NULL); // Zombie state
+            usleep(timeout * 1000);
+            continue;
         }
-    }
-    fclose(status_file);
-    return 0;
-}
 
-// Helper function to get parent PID
-int get_parent_pid_new(int pid)
-{
-    char status_path[256];
-    sprintf(status_path, "/proc/%d/status", pid);
+        if (rescan || sock == -1)
+        {
+            snapshot_build();
+            pending_count = 0;
+            rescan = 0;
+        }
+        tour_ready();
 
-    FILE *status_file = fopen(status_path, "r");
-    if (status_file == NULL)
-    {
-        return -1;
+        for (int r = 0; r < sampler->root_count; r++)
+        {
+            struct sample sample;
+            sample_subtree(sampler->roots[r], &sample);
+            ring_push(&sample);
+        }
+        sampler->ticks++;
+        next_tick += sampler->interval_ms;
     }
 
-    char line[256];
-    while (fgets(line, sizeof(line), status_file))
+    if (sock != -1)
     {
-        if (strncmp(line, "PPid:", 5) == 0)
-        {
-            int ppid;
-            sscanf(line, "PPid: %d", &ppid);
-            fclose(status_file);
-            return ppid;
-        }
+        close(sock);
     }
-    fclose(status_file);
-    return -1;
+    sampler->cpu_ms = thread_cpu_ms() - cpu_started;
+    close(sampler->done_fd); // Wakes the main thread waiting for requests
+    return NULL;
 }
 
-// Recursive function to kill parents of all zombie descendants
-void kill_parents_of_zombies(int process_id)
+// Print one sample as a line of the history
+void write_sample(struct sample *sample)
 {
-    char children_path[256];
-    sprintf(children_path, "/proc/%d/task/%d/children", process_id, process_id);
+    write_text("%.3f %d total=%d zombies=%d stopped=%d orphans=%d rss_kb=%ld cpu_ticks=%llu\n",
+               sample->time, sample->root, sample->total, sample->zombies, sample->stopped,
+               sample->orphans, sample->rss_pages * (sysconf(_SC_PAGESIZE) / 1024), sample->cpu_ticks);
+}
 
-    FILE *child_file = fopen(children_path, "r");
-    if (child_file == NULL)
+// Print the last count samples still in the ring (all of them if count <= 0)
+void write_history(int count)
+{
+    unsigned long long head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+    unsigned long long first = head > (unsigned long long)ring.size ? head - ring.size : 0;
+    if (count > 0 && head - first > (unsigned long long)count)
     {
-        return;
+        first = head - count;
     }
 
-    int child_pid;
-    while (fscanf(child_file, "%d", &child_pid) > 0)
+    output_begin(0, 0, "--sample");
+    for (unsigned long long number = first; number < head; number++)
     {
-        // Recursively handle descendants of this child
-        kill_parents_of_zombies(child_pid);
-
-        // Check if this child is a zombie
-        if (is_zombie(child_pid))
+        struct sample sample;
+        if (ring_read(number, &sample))
         {
-            // Get the parent PID of the zombie process
-            int parent_pid = get_parent_pid(child_pid);
-
-            // Kill the parent of the zombie
-            if (parent_pid > 1 && kill(parent_pid, SIGKILL) == -1)
-            {
-                perror("Failed to kill parent");
-            }
-            else
-            {
-                printf("Killed parent %d of zombie process %d\n", parent_pid, child_pid);
-
-                // Wait for init to clean up the zombie
-                sleep(1); // Short delay to allow cleanup
-
-                // Verify if the zombie is removed
-                if (!does_process_exist(child_pid))
-                {
-                    printf("Zombie process %d has been cleaned up\n", child_pid);
-                }
-                else
-                {
-                    printf("Zombie process %d still exists\n", child_pid);
-                }
-            }
+            write_sample(&sample);
         }
     }
+    output_end(EXIT_SUCCESS);
+    output_flush();
+}
 
-    fclose(child_file);
+void request_stop(int signal_number)
+{
+    (void)signal_number;
+    stop_requested = 1;
 }
 
-// Recursive function to kill all descendants
-void kill_all_descendants(int process_id)
+// Answer one request line of sampling mode
+void answer_sample_request(const char *line)
 {
-    char children_path[256];
-    sprintf(children_path, "/proc/%d/task/%d/children", process_id, process_id);
-    
-    FILE *child_file = fopen(children_path, "r");
-    if (child_file == NULL)
+    int count = 0;
+    if (strncmp(line, "dump", 4) == 0)
     {
-        return;
+        write_history(0);
     }
-
-    int child_pid;
-    while (fscanf(child_file, "%d", &child_pid) > 0)
+    else if (sscanf(line, "last %d", &count) == 1)
     {
-        
-        // Recursively kill descendants of this child
-        kill_all_descendants(child_pid);
-
-        // Check if child is a zombie
-        if (is_zombie(child_pid))
-        {
-            printf("Zombie process detected: PID = %d (Cannot kill zombie directly using SIGKILL)\n", child_pid);
-            // Get the parent PID of the zombie
-            // int parent_pid = get_parent_pid_new(child_pid);
-            // // Kill the parent of the zombie
-            // if (parent_pid > 1 && kill(parent_pid, SIGKILL) == -1)
-            // {
-            //     perror("Failed to kill parent");
-            // }
-            // else
-            // {
-            //     printf("Killed parent %d of zombie process %d\n", parent_pid, child_pid);
-            // }
-
-        }
-        else
-        {
-            // Kill non-zombie processes directly
-            if (kill(child_pid, SIGKILL) == -1)
-            {
-                printf("Failed to kill process");
-            }
-            else
-            {
-                printf("Killed process: %d\n", child_pid);
-            }
-        }
-
-        usleep(50000); // Small delay to ensure signal delivery
+        write_history(count);
+    }
+    else if (strncmp(line, "quit", 4) == 0)
+    {
+        stop_requested = 1;
+    }
+    else
+    {
+        output_begin(0, 0, "--sample");
+        write_text("ERROR:Requests are dump, last N or quit\n");
+        output_end(EXIT_FAILURE);
+        output_flush();
     }
-
-    fclose(child_file);
 }
 
-// Recursive function to send SIGSTOP to all descendants
-void stop_all_descendants(int process_id)
+// prct --sample ROOT[,ROOT...] [interval_ms [ticks]]
+int run_sampler(char *root_list, int interval_ms, int limit)
 {
-    char children_path[256];
-    sprintf(children_path, "/proc/%d/task/%d/children", process_id, process_id);
+    struct sampler sampler = {0};
+    sampler.interval_ms = interval_ms;
+    sampler.limit = limit;
 
-    FILE *child_file = fopen(children_path, "r");
-    if (child_file == NULL)
+    // Everything is allocated up front, ticks reuse it
+    int roots[64];
+    for (char *word = strtok(root_list, ","); word != NULL && sampler.root_count < 64; word = strtok(NULL, ","))
     {
-        return;
+        roots[sampler.root_count] = atoi(word);
+        if (roots[sampler.root_count] <= 0)
+        {
+            printf("ERROR:Process IDs should be a positive number\n");
+            return EXIT_FAILURE;
+        }
+        sampler.root_count++;
     }
-
-    int child_pid;
-    while (fscanf(child_file, "%d", &child_pid) > 0)
+    sampler.roots = roots;
+    ring.size = history_slots * sampler.root_count;
+    ring.slots = calloc(ring.size, sizeof(struct sample_slot));
+    if (ring.slots == NULL || interval_ms <= 0 || sampler.root_count == 0)
     {
-        // Recursively stop descendants of this child
-        stop_all_descendants(child_pid);
-
-        // Check if the process is a zombie
-        char status_path[256];
-        sprintf(status_path, "/proc/%d/status", child_pid);
+        printf("ERROR:Cannot sample with these settings\n");
+        free(ring.slots);
+        return EXIT_FAILURE;
+    }
 
-        FILE *status_file = fopen(status_path, "r");
-        if (status_file == NULL)
-        {
-            continue;
-        }
+    // Ctrl-C ends sampling; the signals go to this thread so a blocked read wakes up
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigset_t blocked;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    int done[2];
+    if (pipe(done) == -1)
+    {
+        perror("pipe");
+        free(ring.slots);
+        return EXIT_FAILURE;
+    }
+    sampler.done_fd = done[1];
+    pthread_sigmask(SIG_BLOCK, &blocked, NULL);
+    int started = pthread_create(&sampler.thread, NULL, sampler_run, &sampler) == 0;
+    pthread_sigmask(SIG_UNBLOCK, &blocked, NULL);
+    if (!started)
+    {
+        perror("pthread_create");
+        close(done[0]);
+        close(done[1]);
+        free(ring.slots);
+        return EXIT_FAILURE;
+    }
 
-        char line[256];
-        int is_zombie = 0;
-        while (fgets(line, sizeof(line), status_file))
+    // Answer history requests until stdin is closed or the sampler is done.
+    // The pipe wakes us when the tick limit is reached while stdin is idle
+    char input[256];
+    int input_length = 0;
+    while (!stop_requested)
+    {
+        struct pollfd polls[2] = {{STDIN_FILENO, POLLIN, 0}, {done[0], POLLIN, 0}};
+        if (poll(polls, 2, -1) == -1)
         {
-            if (strncmp(line, "State:", 6) == 0 && strchr(line, 'Z') != NULL)
+            if (errno == EINTR)
             {
-                is_zombie = 1;
-                break;
+                continue;
             }
+            perror("poll");
+            break;
         }
-        fclose(status_file);
-
-        // Skip zombie processes
-        if (is_zombie)
+        if (polls[1].revents != 0)
+        {
+            break; // The sampler finished
+        }
+        if (polls[0].revents == 0)
         {
-            printf("Process %d is a zombie and cannot be stopped\n", child_pid);
             continue;
         }
 
-        // Send SIGSTOP to non-zombie processes
-        if (kill(child_pid, SIGSTOP) == -1)
+        int length = read(STDIN_FILENO, input + input_length, sizeof(input) - 1 - input_length);
+        if (length <= 0)
         {
-            perror("Failed to stop process");
+            break; // stdin closed
         }
-        else
+        input_length += length;
+
+        // Answer every complete line, keep the unfinished one for next time
+        char *line = input;
+        char *end;
+        while (!stop_requested && (end = memchr(line, '\n', input + input_length - line)) != NULL)
+        {
+            *end = '\0';
+            answer_sample_request(line);
+            line = end + 1;
+        }
+        input_length -= line - input;
+        memmove(input, line, input_length);
+        if (input_length == sizeof(input) - 1)
         {
-            printf("Stopped process: %d\n", child_pid);
+            input_length = 0; // A line this long is not a request
         }
     }
 
-    fclose(child_file);
+    // Without stdin, run until the tick limit or a signal, then print it all
+    pthread_join(sampler.thread, NULL);
+    close(done[0]);
+    write_history(0);
+    fprintf(stderr, "Sampler: %d ticks, %.1f ms CPU (%.3f%% of the sampled time)\n", sampler.ticks,
+            sampler.cpu_ms, sampler.ticks > 0 ? 100.0 * sampler.cpu_ms / ((double)sampler.ticks * interval_ms) : 0.0);
+    free(ring.slots);
+    return EXIT_SUCCESS;
 }
 
-// Recursive function to send SIGCONT to all paused descendants
-void continue_all_paused_descendants(int process_id)
+// Live view: a top-like screen showing the tree below one process with state
+// flags and CPU use. Each frame re-reads stat only for the processes already
+// in the view and looks in their children files for new ones, then redraws
+// just the screen rows whose text changed.
+
+#define VIEW_WIDTH 256 // Longest screen row we draw
+
+// One process on the screen, in tree order
+struct view_row
 {
-    char children_path[256];
-    sprintf(children_path, "/proc/%d/task/%d/children", process_id, process_id);
+    int pid;
+    int depth;
+    double cpu; // Percent of one CPU since the last frame
+};
 
-    FILE *child_file = fopen(children_path, "r");
-    if (child_file == NULL)
+struct view
+{
+    int root;
+    struct view_row *rows;
+    int row_count;
+    int row_capacity;
+    struct view_row *stack;   // Processes still to visit while refreshing
+    int stack_count;
+    int stack_capacity;
+    struct scan_worker reader; // Buffer for children files
+    char (*shown)[VIEW_WIDTH]; // What each screen row shows now
+    int screen_rows;
+    int screen_cols;
+    double last_ms;           // When the previous frame was taken
+    int zombies;
+    int stopped;
+    int orphans;
+    struct text frame;        // Escape codes and text for one redraw
+};
+
+// Append to one of the view's row arrays, returns 0 if memory ran out
+int view_push(struct view_row **rows, int *count, int *capacity, int pid, int depth)
+{
+    if (*count == *capacity)
     {
-        return;
+        int new_capacity = *capacity ? *capacity * 2 : 256;
+        struct view_row *grown = realloc(*rows, new_capacity * sizeof(struct view_row));
+        if (grown == NULL)
+        {
+            return 0;
+        }
+        *rows = grown;
+        *capacity = new_capacity;
     }
+    (*rows)[*count].pid = pid;
+    (*rows)[*count].depth = depth;
+    (*rows)[*count].cpu = 0;
+    (*count)++;
+    return 1;
+}
 
-    int child_pid;
-    while (fscanf(child_file, "%d", &child_pid) > 0)
+// Bring the subtree up to date and list it in tree order. Processes that
+// exited are dropped, processes that moved away are relinked, new children
+// are added, and everything else only has its stat file read again.
+void view_refresh(struct view *view)
+{
+    double now = now_ms();
+    double elapsed_ticks = (now - view->last_ms) / 1000.0 * sysconf(_SC_CLK_TCK);
+    view->last_ms = now;
+    view->row_count = 0;
+    view->stack_count = 0;
+    view->zombies = view->stopped = view->orphans = 0;
+    view_push(&view->stack, &view->stack_count, &view->stack_capacity, view->root, 0);
+
+    // Without children files, new processes are found by listing /proc
+    if (ppid_links)
     {
-        // Recursively continue descendants of this child
-        continue_all_paused_descendants(child_pid);
-
-        // Check if the process is paused (T state)
-        char status_path[256];
-        sprintf(status_path, "/proc/%d/status", child_pid);
+        int *pids;
+        int pid_count = list_proc_pids(&view->reader.memory, &pids);
+        for (int i = 0; i < pid_count; i++)
+        {
+            if (snapshot_lookup(pids[i]) == NULL)
+            {
+                snapshot_add(pids[i]);
+            }
+        }
+        arena_free(&view->reader.memory);
+    }
 
-        FILE *status_file = fopen(status_path, "r");
-        if (status_file == NULL)
+    while (view->stack_count > 0)
+    {
+        struct view_row next = view->stack[--view->stack_count];
+        struct proc_entry *entry = snapshot_lookup(next.pid);
+        struct proc_entry fresh;
+        if (entry == NULL)
+        {
+            continue;
+        }
+        if (!read_stat_entry(next.pid, &fresh))
+        {
+            snapshot_remove(next.pid); // Exited and reaped
+            continue;
+        }
+        if (next.depth > 0 && fresh.ppid != entry->ppid)
         {
+            snapshot_refresh_parent(next.pid); // Reparented out of this subtree
             continue;
         }
 
-        char line[256];
-        int is_paused = 0;
-        while (fgets(line, sizeof(line), status_file))
+        // CPU use is the growth of the time counters since the last frame
+        unsigned long long before = entry->utime + entry->stime;
+        unsigned long long after = fresh.utime + fresh.stime;
+        snapshot_set_state(entry, fresh.state);
+        entry->utime = fresh.utime;
+        entry->stime = fresh.stime;
+        entry->rss = fresh.rss;
+
+        if (!view_push(&view->rows, &view->row_count, &view->row_capacity, next.pid, next.depth))
+        {
+            return;
+        }
+        view->rows[view->row_count - 1].cpu = elapsed_ticks > 0 && after >= before ? 100.0 * (after - before) / elapsed_ticks : 0;
+        view->zombies += fresh.state == 'Z';
+        view->stopped += fresh.state == 'T';
+        view->orphans += fresh.ppid == 1;
+
+        // Pick up children we have not seen yet
+        view->reader.children_count = 0;
+        if (!ppid_links)
+        {
+            read_children_file(next.pid, &view->reader);
+        }
+        for (int i = 0; i < view->reader.children_count; i++)
         {
-            if (strncmp(line, "State:", 6) == 0 && strchr(line, 'T') != NULL)
+            struct proc_entry *known = snapshot_lookup(view->reader.children[i]);
+            if (known == NULL || known->ppid != next.pid)
             {
-                is_paused = 1;
-                break;
+                snapshot_add(view->reader.children[i]);
             }
         }
-        fclose(status_file);
 
-        // Send SIGCONT to paused processes
-        if (is_paused)
+        // Visit the children next, first child on top of the stack
+        int first = view->stack_count;
+        entry = snapshot_lookup(next.pid); // Adding may have moved the table
+        for (struct proc_entry *child = first_child_of(entry); child != NULL; child = next_sibling_of(child))
         {
-            if (kill(child_pid, SIGCONT) == -1)
-            {
-                perror("Failed to continue process");
-            }
-            else
-            {
-                printf("Resumed process: %d\n", child_pid);
-            }
+            view_push(&view->stack, &view->stack_count, &view->stack_capacity, child->pid, next.depth + 1);
+        }
+        for (int low = first, high = view->stack_count - 1; low < high; low++, high--)
+        {
+            struct view_row swap = view->stack[low];
+            view->stack[low] = view->stack[high];
+            view->stack[high] = swap;
         }
     }
-
-    fclose(child_file);
 }
 
-// Function to kill a specific process and handle zombies
-void kill_root_process(int root_process, int process_id)
+// Put one screen row in place if it differs from what is shown there
+void view_draw_row(struct view *view, int y, const char *line)
 {
-    // Ensure the root process is valid
-    if (!is_root_process(root_process))
+    if (strcmp(view->shown[y], line) == 0)
     {
-        printf("Error: %d is not a root process\n", root_process);
         return;
     }
+    char move[32];
+    int length = snprintf(move, sizeof(move), "\033[%d;1H", y + 1);
+    text_append(&view->frame, move, length);
+    text_append(&view->frame, line, strlen(line));
+    text_append(&view->frame, "\033[K", 3);
+    strcpy(view->shown[y], line);
+}
 
-    // Check if the process_id belongs to the tree rooted at root_process
-    if (!is_process_in_tree(root_process, process_id))
+// Draw the frame, only sending the rows that changed since the last one
+void view_draw(struct view *view)
+{
+    struct winsize size;
+    int rows = 24;
+    int cols = 80;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_row > 0)
     {
-        printf("Error: Process %d does not belong to the tree rooted at %d\n", process_id, root_process);
-        return;
+        rows = size.ws_row;
+        cols = size.ws_col;
     }
-
-    // Check if the process is a zombie
-    if (is_zombie(process_id))
+    if (cols > VIEW_WIDTH - 1)
     {
-        // Get the parent PID of the zombie process
-        int parent_pid = get_parent_pid(process_id);
+        cols = VIEW_WIDTH - 1;
+    }
 
-        // Kill the parent of the zombie
-        if (parent_pid > 1 && kill(parent_pid, SIGKILL) == -1)
+    view->frame.length = 0;
+    if (rows != view->screen_rows || cols != view->screen_cols)
+    {
+        // New terminal size: start from a clear screen
+        char (*shown)[VIEW_WIDTH] = realloc(view->shown, rows * sizeof(*shown));
+        if (shown == NULL)
         {
-            perror("Failed to kill parent");
+            return;
         }
-        else
+        view->shown = shown;
+        view->screen_rows = rows;
+        view->screen_cols = cols;
+        for (int y = 0; y < rows; y++)
         {
-            printf("Killed parent %d of zombie process %d\n", parent_pid, process_id);
+            strcpy(view->shown[y], "");
         }
-
-        // Zombie will be cleaned up by init after killing its parent
+        text_append(&view->frame, "\033[2J", 4);
     }
-    else
+
+    char line[VIEW_WIDTH];
+    snprintf(line, cols + 1, "Tree of %d: %d processes, %d zombies, %d stopped, %d orphans  (q quits)",
+             view->root, view->row_count, view->zombies, view->stopped, view->orphans);
+    view_draw_row(view, 0, line);
+    snprintf(line, cols + 1, "%7s %s %s %6s %10s  %s", "PID", "S", "O", "CPU%", "RSS_KB", "COMMAND");
+    view_draw_row(view, 1, line);
+
+    long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    for (int y = 2; y < rows; y++)
     {
-        // Kill non-zombie processes directly
-        if (kill(process_id, SIGKILL) == -1)
+        line[0] = '\0';
+        if (y - 2 < view->row_count)
         {
-            perror("Failed to kill process");
+            struct view_row *row = &view->rows[y - 2];
+            struct proc_entry *entry = snapshot_lookup(row->pid);
+            int indent = row->depth < 30 ? row->depth * 2 : 60;
+            snprintf(line, cols + 1, "%7d %c %c %6.1f %10ld  %*s%s", row->pid, entry->state,
+                     entry->ppid == 1 ? 'O' : ' ', row->cpu, entry->rss * page_kb, indent, "", entry->comm);
         }
-        else
+        view_draw_row(view, y, line);
+    }
+
+    size_t written = 0;
+    while (written < view->frame.length)
+    {
+        ssize_t result = write(STDOUT_FILENO, view->frame.data + written, view->frame.length - written);
+        if (result == -1 && errno != EINTR)
         {
-            printf("Killed process: %d\n", process_id);
+            break;
         }
+        written += result > 0 ? result : 0;
     }
 }
 
-int main(int argc, char *argv[])
+// prct --view ROOT [interval_ms [frames]]
+int run_view(int root, int interval_ms, int limit)
 {
-    if (argc < 3)
+    if (root <= 0 || interval_ms <= 0)
     {
-        printf("ERROR:Number of arguments are less than required\n");
-        exit(EXIT_FAILURE);
+        printf("ERROR:Process IDs and the interval should be positive numbers\n");
+        return EXIT_FAILURE;
+    }
+    double started = now_ms();
+    if (find_process(root) == NULL)
+    {
+        printf("Process %d doesn't exist!\n", root);
+        return EXIT_FAILURE;
     }
 
-    pid_t root_process = atoi(argv[1]);
-    pid_t process_id = atoi(argv[2]);
-    char *option = argc == 4 ? argv[3] : NULL;
+    struct view view;
+    memset(&view, 0, sizeof(view));
+    view.root = root;
+    view.last_ms = started;
 
-    // Valid Inputs
-    if (process_id <= 0 || root_process <= 0)
+    // Read keys one at a time without echo, and use the alternate screen
+    struct termios saved;
+    int keyboard = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &saved) == 0;
+    if (keyboard)
     {
-        printf("ERROR:Process IDs should be a positive number\n");
-        exit(EXIT_FAILURE);
+        struct termios raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        raw.c_cc[VMIN] = 0;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
     }
-
-    // First check if process exists
-    if (!does_process_exist(process_id))
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    if (write(STDOUT_FILENO, "\033[?1049h\033[?25l", 14) == -1)
     {
-        printf("Process %d doesn't exist!\n", process_id);
-        return EXIT_FAILURE;
+        perror("write");
     }
 
-    // Special handling for -so option
-    if (argc == 4 && strcmp(argv[3], "-so") == 0)
+    int frames = 0;
+    int status = EXIT_SUCCESS;
+    while (!stop_requested && (limit == 0 || frames < limit))
     {
-        check_if_orphan(process_id);
-        return EXIT_SUCCESS;
+        view_refresh(&view);
+        if (view.row_count == 0)
+        {
+            status = EXIT_FAILURE; // The root exited
+            break;
+        }
+        view_draw(&view);
+        frames++;
+
+        // Sleep until the next frame, waking up early for a key press
+        struct pollfd keys = {STDIN_FILENO, POLLIN, 0};
+        char key = 0;
+        if (poll(&keys, keyboard ? 1 : 0, interval_ms) > 0 && read(STDIN_FILENO, &key, 1) == 1 && key == 'q')
+        {
+            break;
+        }
     }
-    // If -op option is provided
-    if (argc == 4 && strcmp(argv[3], "-op") == 0)
+
+    if (write(STDOUT_FILENO, "\033[?25h\033[?1049l", 14) == -1)
     {
-        list_orphan_descendants(process_id);
+        perror("write");
     }
-
-    // Now check tree membership for all other options
-    if (!is_process_in_tree(root_process, process_id))
+    if (keyboard)
     {
-        printf("Process %d does not belong to the tree rooted at %d\n", process_id, root_process);
-        // printf("Orphan\n");
-        return EXIT_FAILURE;
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved);
     }
-
-    if (!is_root_process(root_process))
+    if (status != EXIT_SUCCESS)
     {
-        printf("Process %d is not the root process\n", process_id);
-        return EXIT_FAILURE;
+        printf("Process %d exited\n", root);
     }
+    free(view.rows);
+    free(view.stack);
+    free(view.shown);
+    free(view.frame.data);
+    arena_free(&view.reader.memory);
+    return status;
+}
 
-    // If no option provided (argc == 3), print PID and PPID
-    if (argc == 3)
+int main(int argc, char *argv[])
+{
+    if (!parse_global_flags(&argc, argv))
     {
-        printf("Process %d exists!\n", process_id);
-        printf("PPid: %d\n", get_parent_pid(process_id));
-        printf("PID %d belongs to tree rooted at %d\n", process_id, root_process);
-        return EXIT_SUCCESS;
+        exit(EXIT_FAILURE);
     }
+    out.interactive = out.format == FORMAT_PLAIN && isatty(STDOUT_FILENO);
 
-    // If -id option is provided
-    if (argc == 4 && strcmp(argv[3], "-id") == 0)
+    // A snapshot file that cannot be used is an error before any query
+    if (snapshot_file != NULL && !snapshot_build())
     {
-        list_immediate_descendants(process_id);
+        exit(EXIT_FAILURE);
     }
-
-    // If -ds option is provided
-    if (argc == 4 && strcmp(argv[3], "-ds") == 0)
+    if (show_stats)
     {
-        list_non_direct_descendants(process_id);
+        atexit(print_stats);
     }
 
-    // If -lg option is provided
-    if (argc == 4 && strcmp(argv[3], "-lg") == 0)
+    // Watch mode answers queries from stdin instead of the command line
+    if (argc == 2 && strcmp(argv[1], "--watch") == 0)
     {
-        list_siblings(process_id);
+        if (snapshot_file != NULL)
+        {
+            printf("ERROR:Watch mode follows live processes, it cannot use --from\n");
+            exit(EXIT_FAILURE);
+        }
+        return run_watch();
     }
 
-    // If -lg option is provided
-    if (argc == 4 && strcmp(argv[3], "-gc") == 0)
+    // Record subtree counters at an interval
+    if (argc >= 3 && argc <= 5 && strcmp(argv[1], "--sample") == 0)
     {
-        list_grandchildren(process_id);
+        return run_sampler(argv[2], argc >= 4 ? atoi(argv[3]) : 1000, argc == 5 ? atoi(argv[4]) : 0);
     }
 
-    // If -do option is provided
-    if (argc == 4 && strcmp(argv[3], "-do") == 0)
+    // Show a live, refreshing view of a subtree
+    if (argc >= 3 && argc <= 5 && strcmp(argv[1], "--view") == 0)
     {
-        check_if_defunct(process_id);
+        return run_view(atoi(argv[2]), argc >= 4 ? atoi(argv[3]) : 1000, argc == 5 ? atoi(argv[4]) : 0);
     }
 
-    // If -lz option is provided
-    if (argc == 4 && strcmp(argv[3], "-lz") == 0)
+    // Compare two captures of the process tree
+    if ((argc == 4 || argc == 5) && strcmp(argv[1], "--diff") == 0)
     {
-        list_defunct_siblings(process_id);
+        if (argc == 5 && atoi(argv[4]) <= 0)
+        {
+            printf("ERROR:Process IDs should be a positive number\n");
+            exit(EXIT_FAILURE);
+        }
+        return run_diff(argv[2], argv[3], argc == 5 ? atoi(argv[4]) : 0);
     }
 
-    // If -df option is provided
-    if (argc == 4 && strcmp(argv[3], "-df") == 0)
+    // Save the process tree for later queries with --from
+    if (argc == 3 && strcmp(argv[1], "--save") == 0)
     {
-        list_defunct_descendants(process_id);
+        return save_snapshot(argv[2]);
     }
 
-    // If -dc option is provided
-    if (argc == 4 && strcmp(argv[3], "-dc") == 0)
+    // Compare the plain and io_uring stat readers on the live /proc
+    if (argc == 2 && strcmp(argv[1], "--bench-read") == 0)
     {
-        // printf("[DEBUG] Executing -dc option\n");
-        count_defunct_descendants(atoi(argv[2]));
+        return run_read_benchmark();
     }
 
-    // If -so option is provided
-    if (argc == 4 && strcmp(argv[3], "-so") == 0)
+    // Compare the two ways of building the tree on the live /proc
+    if (argc == 2 && strcmp(argv[1], "--bench-build") == 0)
     {
-        check_if_orphan(process_id);
+        return run_build_benchmark();
     }
 
-    // If -op option is provided
-    if (argc == 4 && strcmp(argv[3], "-op") == 0)
+    // Compare the process table layouts on synthetic trees
+    if (argc == 2 && strcmp(argv[1], "--bench-layout") == 0)
     {
-        list_orphan_descendants(process_id);
+        return run_layout_benchmark();
     }
 
-    // If -pz option is provided
-    if (argc == 4 && strcmp(argv[3], "--pz") == 0)
+    // Batch mode answers many queries from a file or stdin with one scan
+    if ((argc == 2 || argc == 3) && strcmp(argv[1], "--batch") == 0)
     {
-        kill_parents_of_zombies(process_id);
+        return run_batch(argc == 3 ? argv[2] : NULL);
     }
 
-    // If -sk option is provided
-    if (argc == 4 && strcmp(argv[3], "-sk") == 0)
+    // Server mode keeps the index warm and answers queries over a Unix socket
+    if (argc == 3 && strcmp(argv[1], "--serve") == 0)
     {
-        if (!is_root_process(root_process))
-        {
-            printf("Error: %d is not a root process\n", root_process);
-            return EXIT_FAILURE;
-        }
-
-        // if (process_id != root_process) {
-        //     printf("Only root process can kill all descendants\n");
-        //     return EXIT_FAILURE;
-        // }
-
-        kill_all_descendants(process_id);
+        return run_server(argv[2]);
     }
 
-    // If -st option is provide
-    if (argc == 4 && strcmp(argv[3], "-st") == 0)
+    // Client mode forwards one query to a running server
+    if ((argc == 5 || argc == 6) && strcmp(argv[1], "--client") == 0)
     {
-        if (!is_root_process(root_process))
-        {
-            printf("Error: %d is not a root process\n", root_process);
-            return EXIT_FAILURE;
-        }
-
-        // if (process_id != root_process) {
-        //     printf("Only root process can send SIGSTOP to all descendants\n");
-        //     return EXIT_FAILURE;
-        // }
-
-        stop_all_descendants(process_id);
+        return run_client(argv[2], argc - 3, argv + 3);
     }
 
-    // If -sc option is provide
-    if (argc == 4 && strcmp(argv[3], "-dt") == 0)
+    if (argc < 3)
     {
-        if (!is_root_process(root_process))
-        {
-            printf("Error: %d is not a root process\n", root_process);
-            return EXIT_FAILURE;
-        }
-
-        // if (process_id != root_process) {
-        //     printf("Only root process can send SIGCONT to all paused descendants\n");
-        //     return EXIT_FAILURE;
-        // }
-
-        continue_all_paused_descendants(process_id);
+        printf("ERROR:Number of arguments are less than required\n");
+        exit(EXIT_FAILURE);
     }
 
-    // If -rp option is provide
-    if (argc == 4 && strcmp(argv[3], "-rp") == 0)
+    pid_t root_process = atoi(argv[1]);
+    pid_t process_id = atoi(argv[2]);
+    char *option = argc == 4 ? argv[3] : NULL;
+
+    // Valid Inputs
+    if (process_id <= 0 || root_process <= 0)
     {
-        
-        if (process_id != root_process) {
-            printf("Only root process have to be killed using -rp\n");
-            return EXIT_FAILURE;
-        }
-        kill_root_process(root_process, root_process);
+        printf("ERROR:Process IDs should be a positive number\n");
+        exit(EXIT_FAILURE);
     }
 
-    return 0;
+    output_begin(root_process, process_id, option);
+    int status = run_query(root_process, process_id, option);
+    output_end(status);
+    output_finish();
+    return status;
 }